@@ -0,0 +1,145 @@
+#include <stdint.h>
+#include <string.h>
+#include "adpcm.h"
+
+// Step size multipliers, in 1/256ths, indexed by the magnitude bits of a nibble.
+// These are the ones the AICA uses for its Yamaha ADPCM.
+static const int adpcm_scale[8] = { 230, 230, 230, 230, 307, 409, 512, 614 };
+
+#define ADPCM_STEP_MIN 127
+#define ADPCM_STEP_MAX 24576
+
+int adpcm_is_prerendered(const char *filename)
+{
+    int namelen = strlen(filename);
+    int suffixlen = strlen(ADPCM_SUFFIX);
+
+    return namelen > suffixlen && strcmp(filename + (namelen - suffixlen), ADPCM_SUFFIX) == 0;
+}
+
+int adpcm_check_header(adpcm_header_t *header)
+{
+    if (memcmp(header->magic, "ADPC", 4) != 0)
+    {
+        return -1;
+    }
+    if (header->samplerate < 6000 || header->samplerate > 48000 || (header->channels != 1 && header->channels != 2))
+    {
+        return -2;
+    }
+    if (header->chunk_samples == 0 || header->chunk_samples > ADPCM_MAX_CHUNK_SAMPLES || (header->chunk_samples & 1) != 0)
+    {
+        return -3;
+    }
+    if (header->loop_start != ADPCM_NO_LOOP && (header->loop_start >= header->loop_end || header->loop_end > header->numsamples))
+    {
+        return -4;
+    }
+    if (header->loop_start != ADPCM_NO_LOOP && ((header->loop_start | header->loop_end) & 1) != 0)
+    {
+        // Loops have to land on a whole byte.
+        return -5;
+    }
+
+    // Make sure these are always safe to display.
+    header->title[sizeof(header->title) - 1] = 0;
+    header->source[sizeof(header->source) - 1] = 0;
+    return 0;
+}
+
+unsigned int adpcm_channel_bytes(adpcm_header_t *header)
+{
+    // Two samples a byte, no state, since each channel is one continuous stream.
+    return header->chunk_samples / 2;
+}
+
+unsigned int adpcm_chunk_bytes(adpcm_header_t *header)
+{
+    return adpcm_channel_bytes(header) * header->channels;
+}
+
+void adpcm_reset(adpcm_state_t *state)
+{
+    state->prev = ADPCM_INITIAL_PREV;
+    state->step = ADPCM_INITIAL_STEP;
+}
+
+static int adpcm_step(int *prev, int step, unsigned int nibble)
+{
+    int diff = (step * (((nibble & 7) * 2) + 1)) >> 3;
+
+    if (nibble & 8)
+    {
+        *prev -= diff;
+        if (*prev < -32768) { *prev = -32768; }
+    }
+    else
+    {
+        *prev += diff;
+        if (*prev > 32767) { *prev = 32767; }
+    }
+
+    step = (step * adpcm_scale[nibble & 7]) >> 8;
+    if (step < ADPCM_STEP_MIN) { step = ADPCM_STEP_MIN; }
+    else if (step > ADPCM_STEP_MAX) { step = ADPCM_STEP_MAX; }
+    return step;
+}
+
+void adpcm_decode(adpcm_state_t *state, int16_t *out, unsigned int stride, const uint8_t *data, unsigned int position, unsigned int numsamples)
+{
+    int prev = state->prev;
+    int step = state->step;
+
+    for (unsigned int i = position; i < position + numsamples; i++)
+    {
+        unsigned int nibble = (data[i >> 1] >> ((i & 1) * 4)) & 0xF;
+        step = adpcm_step(&prev, step, nibble);
+
+        *out = prev;
+        out += stride;
+    }
+
+    state->prev = prev;
+    state->step = step;
+}
+
+void adpcm_encode(adpcm_state_t *state, uint8_t *data, unsigned int position, const int16_t *in, unsigned int stride, unsigned int numsamples)
+{
+    int prev = state->prev;
+    int step = state->step;
+
+    for (unsigned int i = position; i < position + numsamples; i++)
+    {
+        int delta = *in - prev;
+        unsigned int nibble = 0;
+        in += stride;
+
+        if (delta < 0)
+        {
+            nibble = 8;
+            delta = -delta;
+        }
+
+        // Largest magnitude whose step doesn't overshoot, which is (4 * delta) / step
+        // capped at 7, without a divide.
+        int scaled = delta * 4;
+        if (scaled >= step * 4) { nibble |= 4; scaled -= step * 4; }
+        if (scaled >= step * 2) { nibble |= 2; scaled -= step * 2; }
+        if (scaled >= step) { nibble |= 1; }
+
+        step = adpcm_step(&prev, step, nibble);
+
+        uint8_t *byte = &data[i >> 1];
+        if (i & 1)
+        {
+            *byte = (*byte & 0x0F) | (nibble << 4);
+        }
+        else
+        {
+            *byte = (*byte & 0xF0) | nibble;
+        }
+    }
+
+    state->prev = prev;
+    state->step = step;
+}
@@ -0,0 +1,63 @@
+#ifndef __ADPCM_H
+#define __ADPCM_H
+
+#include <stdint.h>
+
+// Suffix tools/adpcm_prerender.py appends to tracks it pre-rendered.
+#define ADPCM_SUFFIX ".adp"
+
+// Loop start of a track that plays once and stops.
+#define ADPCM_NO_LOOP 0xFFFFFFFF
+
+// Largest chunk we will read at once, which bounds the buffers playback allocates.
+// The pre-render tool writes chunks of 4096 samples.
+#define ADPCM_MAX_CHUNK_SAMPLES 16384
+
+// Decoder state the AICA starts every ADPCM channel in, which is where each
+// channel's stream starts from too.
+#define ADPCM_INITIAL_PREV 0
+#define ADPCM_INITIAL_STEP 127
+
+typedef struct
+{
+    char magic[4];
+    uint32_t samplerate;
+    uint32_t channels;
+    uint32_t numsamples;
+    uint32_t loop_start;
+    uint32_t loop_end;
+    uint32_t chunk_samples;
+    char title[128];
+    char source[16];
+} adpcm_header_t;
+
+typedef struct
+{
+    int prev;
+    int step;
+} adpcm_state_t;
+
+// Returns nonzero if this is a track that was pre-rendered at build time.
+int adpcm_is_prerendered(const char *filename);
+
+// Returns 0 if a header read from a pre-rendered file is one we can play.
+int adpcm_check_header(adpcm_header_t *header);
+
+// Size in bytes of a single channel's part of a chunk, and of a whole chunk.
+unsigned int adpcm_channel_bytes(adpcm_header_t *header);
+unsigned int adpcm_chunk_bytes(adpcm_header_t *header);
+
+// Put a decoder in the state the AICA starts a channel in.
+void adpcm_reset(adpcm_state_t *state);
+
+// Decode samples of one channel into every stride'th sample of out, exactly the way
+// the AICA does it in hardware, starting at sample position within data. Each
+// channel is one continuous stream, so the state carries on from one call to the
+// next, including when a track goes back to its loop start.
+void adpcm_decode(adpcm_state_t *state, int16_t *out, unsigned int stride, const uint8_t *data, unsigned int position, unsigned int numsamples);
+
+// Encode every stride'th sample of in into data starting at sample position, the
+// same way tools/adpcm_prerender.py does, so a stream can be built a bit at a time.
+void adpcm_encode(adpcm_state_t *state, uint8_t *data, unsigned int position, const int16_t *in, unsigned int stride, unsigned int numsamples);
+
+#endif
@@ -0,0 +1,279 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <naomi/thread.h>
+#include <naomi/interrupt.h>
+#include "mixer.h"
+#include "aicastream.h"
+
+// The AICA as the SH-4 sees it, uncached.
+#define AICA_CHANNEL_REG(channel, reg) (*((volatile uint32_t *)(0xA0700000 + ((channel) * 0x80) + (reg))))
+#define AICA_COMMON_REG(reg) (*((volatile uint32_t *)(0xA0700000 + (reg))))
+#define AICA_WAVE_RAM(offset) (*((volatile uint32_t *)(0xA0800000 + (offset))))
+
+// Everything on the G2 bus goes through a FIFO that we have to wait on.
+#define G2_FIFO_STATUS (*((volatile uint32_t *)0xA05F688C))
+#define G2_FIFO_BUSY 0x11
+
+// Per channel registers.
+#define AICA_PLAY_CONTROL 0x00
+#define AICA_SAMPLE_ADDRESS 0x04
+#define AICA_LOOP_START 0x08
+#define AICA_LOOP_END 0x0C
+#define AICA_ENVELOPE 0x10
+#define AICA_RELEASE 0x14
+#define AICA_PITCH 0x18
+#define AICA_LFO 0x1C
+#define AICA_DSP_SEND 0x20
+#define AICA_DIRECT 0x24
+#define AICA_LEVEL 0x28
+
+// Bits in the play control register. Format 3 is ADPCM that keeps its decoder state
+// when it loops, which is what lets it play a ring continuously.
+#define AICA_KEY_ON_EXECUTE 0x8000
+#define AICA_KEY_ON 0x4000
+#define AICA_LOOP 0x0200
+#define AICA_FORMAT_ADPCM_STREAM (3 << 7)
+
+// Fastest attack and release, the lowpass filter off, and panning hard to either side.
+#define AICA_ENVELOPE_INSTANT 0x1F
+#define AICA_FILTER_OFF 0x20
+#define AICA_DIRECT_FULL (0xF << 8)
+#define AICA_PAN_LEFT 0x1F
+#define AICA_PAN_RIGHT 0x0F
+#define AICA_PAN_CENTER 0x00
+
+// Select a channel and read back where in its sample it is.
+#define AICA_MONITOR_SELECT 0x280C
+#define AICA_MONITOR_ADDRESS 0x2814
+
+// Each unit of total level attenuates by 0.375dB.
+#define AICA_LEVEL_STEP_DB 0.375
+
+#define RING_BYTES (AICASTREAM_RING_SAMPLES / 2)
+
+struct aicastream
+{
+    unsigned int channels;
+    uint32_t control[2];
+
+    // Samples per channel handed to us, and played by the hardware.
+    unsigned int written;
+    unsigned int played;
+    unsigned int lastaddress;
+    int started;
+
+    // Bytes waiting for the rest of their 32-bit word, one word per channel.
+    uint8_t pending[2][4];
+    unsigned int pendingbytes;
+};
+
+static int busy = 0;
+
+static void g2_wait()
+{
+    while (G2_FIFO_STATUS & G2_FIFO_BUSY) { ; }
+}
+
+static uint32_t aica_pitch(unsigned int samplerate)
+{
+    // The hardware plays at 44100Hz times 2 to the octave, times 1 + fns / 1024.
+    uint32_t base = 44100 * 128;
+    int octave = 7;
+    while (samplerate < base && octave > -8)
+    {
+        base >>= 1;
+        octave--;
+    }
+
+    uint32_t fns = ((samplerate << 10) / base) & 0x3FF;
+    return ((octave & 0xF) << 11) | fns;
+}
+
+static uint32_t aica_level(int gain)
+{
+    // We can only take volume away, so anything above unity plays at full volume.
+    if (gain >= MIXER_UNITY_GAIN)
+    {
+        return 0;
+    }
+    if (gain <= 0)
+    {
+        return 0xFF;
+    }
+
+    int level = (int)((-20.0 * log10((double)gain / (double)MIXER_UNITY_GAIN)) / AICA_LEVEL_STEP_DB + 0.5);
+    return level > 0xFF ? 0xFF : level;
+}
+
+static unsigned int read_address(unsigned int channel)
+{
+    unsigned int address;
+
+    ATOMIC({
+        g2_wait();
+        AICA_COMMON_REG(AICA_MONITOR_SELECT) = (AICA_COMMON_REG(AICA_MONITOR_SELECT) & 0xFFFF00FF) | (channel << 8);
+        g2_wait();
+        address = AICA_COMMON_REG(AICA_MONITOR_ADDRESS) & 0xFFFF;
+    });
+
+    return address;
+}
+
+aicastream_t *aicastream_open(unsigned int samplerate, unsigned int channels, int gain)
+{
+    if (channels < 1 || channels > 2)
+    {
+        return 0;
+    }
+
+    int claimed = 0;
+    ATOMIC({
+        if (!busy)
+        {
+            busy = 1;
+            claimed = 1;
+        }
+    });
+    if (!claimed)
+    {
+        return 0;
+    }
+
+    aicastream_t *stream = malloc(sizeof(aicastream_t));
+    if (stream == 0)
+    {
+        busy = 0;
+        return 0;
+    }
+    memset(stream, 0, sizeof(aicastream_t));
+    stream->channels = channels;
+
+    uint32_t pitch = aica_pitch(samplerate);
+    uint32_t level = aica_level(gain);
+    for (unsigned int ch = 0; ch < channels; ch++)
+    {
+        unsigned int channel = AICASTREAM_FIRST_CHANNEL + ch;
+        uint32_t address = AICASTREAM_RAM_OFFSET + (ch * RING_BYTES);
+        uint32_t pan = channels == 1 ? AICA_PAN_CENTER : (ch == 0 ? AICA_PAN_LEFT : AICA_PAN_RIGHT);
+
+        // The ring loops forever, it's up to us to stay ahead of the hardware.
+        stream->control[ch] = AICA_FORMAT_ADPCM_STREAM | AICA_LOOP | ((address >> 16) & 0x7F);
+
+        ATOMIC({
+            g2_wait();
+            AICA_CHANNEL_REG(channel, AICA_PLAY_CONTROL) = stream->control[ch] | AICA_KEY_ON_EXECUTE;
+            AICA_CHANNEL_REG(channel, AICA_SAMPLE_ADDRESS) = address & 0xFFFF;
+            AICA_CHANNEL_REG(channel, AICA_LOOP_START) = 0;
+            AICA_CHANNEL_REG(channel, AICA_LOOP_END) = AICASTREAM_RING_SAMPLES;
+            g2_wait();
+            AICA_CHANNEL_REG(channel, AICA_ENVELOPE) = AICA_ENVELOPE_INSTANT;
+            AICA_CHANNEL_REG(channel, AICA_RELEASE) = AICA_ENVELOPE_INSTANT;
+            AICA_CHANNEL_REG(channel, AICA_PITCH) = pitch;
+            AICA_CHANNEL_REG(channel, AICA_LFO) = 0;
+            g2_wait();
+            AICA_CHANNEL_REG(channel, AICA_DSP_SEND) = 0;
+            AICA_CHANNEL_REG(channel, AICA_DIRECT) = AICA_DIRECT_FULL | pan;
+            AICA_CHANNEL_REG(channel, AICA_LEVEL) = (level << 8) | AICA_FILTER_OFF;
+        });
+    }
+
+    return stream;
+}
+
+int aicastream_space(aicastream_t *stream)
+{
+    unsigned int played = aicastream_position(stream);
+    unsigned int flushed = stream->written - (stream->pendingbytes * 2);
+    if (played > flushed)
+    {
+        return -1;
+    }
+
+    // Stay a word clear of wherever the hardware is reading.
+    int space = (int)AICASTREAM_RING_SAMPLES - (int)(stream->written - played) - 8;
+    return space > 0 ? space & ~1 : 0;
+}
+
+void aicastream_write(aicastream_t *stream, const uint8_t **data, unsigned int numsamples)
+{
+    unsigned int bytes = numsamples / 2;
+
+    for (unsigned int ch = 0; ch < stream->channels; ch++)
+    {
+        uint8_t *word = stream->pending[ch];
+        unsigned int pending = stream->pendingbytes;
+        unsigned int position = ((stream->written / 2) - pending) % RING_BYTES;
+        unsigned int base = AICASTREAM_RAM_OFFSET + (ch * RING_BYTES);
+        unsigned int words = 0;
+
+        for (unsigned int i = 0; i < bytes; i++)
+        {
+            word[pending++] = data[ch][i];
+            if (pending == 4)
+            {
+                // The FIFO only holds so many writes, so check in on it every few.
+                if ((words++ & 7) == 0)
+                {
+                    g2_wait();
+                }
+
+                AICA_WAVE_RAM(base + position) = word[0] | (word[1] << 8) | (word[2] << 16) | ((uint32_t)word[3] << 24);
+                position += 4;
+                if (position >= RING_BYTES) { position = 0; }
+                pending = 0;
+            }
+        }
+    }
+
+    stream->written += bytes * 2;
+    stream->pendingbytes = (stream->written / 2) % 4;
+}
+
+void aicastream_start(aicastream_t *stream)
+{
+    ATOMIC({
+        g2_wait();
+        for (unsigned int ch = 0; ch < stream->channels; ch++)
+        {
+            AICA_CHANNEL_REG(AICASTREAM_FIRST_CHANNEL + ch, AICA_PLAY_CONTROL) = stream->control[ch] | AICA_KEY_ON;
+        }
+
+        // Executing a key on starts every channel that has it set, so ours start together.
+        g2_wait();
+        AICA_CHANNEL_REG(AICASTREAM_FIRST_CHANNEL, AICA_PLAY_CONTROL) = stream->control[0] | AICA_KEY_ON | AICA_KEY_ON_EXECUTE;
+    });
+
+    stream->lastaddress = 0;
+    stream->started = 1;
+}
+
+unsigned int aicastream_position(aicastream_t *stream)
+{
+    if (!stream->started)
+    {
+        return 0;
+    }
+
+    unsigned int address = read_address(AICASTREAM_FIRST_CHANNEL);
+    stream->played += (address + AICASTREAM_RING_SAMPLES - stream->lastaddress) % AICASTREAM_RING_SAMPLES;
+    stream->lastaddress = address;
+    return stream->played;
+}
+
+void aicastream_close(aicastream_t *stream)
+{
+    ATOMIC({
+        g2_wait();
+        for (unsigned int ch = 0; ch < stream->channels; ch++)
+        {
+            AICA_CHANNEL_REG(AICASTREAM_FIRST_CHANNEL + ch, AICA_PLAY_CONTROL) = stream->control[ch];
+        }
+        g2_wait();
+        AICA_CHANNEL_REG(AICASTREAM_FIRST_CHANNEL, AICA_PLAY_CONTROL) = stream->control[0] | AICA_KEY_ON_EXECUTE;
+    });
+
+    free(stream);
+    busy = 0;
+}
@@ -0,0 +1,43 @@
+#ifndef __AICASTREAM_H
+#define __AICASTREAM_H
+
+#include <stdint.h>
+
+// Samples per channel in each ring in sound RAM. The loop end register is 16 bits,
+// and everything we write goes in whole 32-bit words, so this is as big as it gets.
+#define AICASTREAM_RING_SAMPLES 0xFFF8
+
+// Sound channels and the spot at the top of sound RAM that we take for ourselves,
+// well away from libnaomi's firmware and the mixer's ring buffer.
+#define AICASTREAM_FIRST_CHANNEL 62
+#define AICASTREAM_RAM_OFFSET 0x1F0000
+
+typedef struct aicastream aicastream_t;
+
+// Set up sound channels that play 4-bit AICA ADPCM straight out of a ring in sound
+// RAM, decoded by the hardware, one per channel of the track. Gain is 4.12 fixed
+// point like the mixer's, but the hardware can only attenuate. Returns 0 if the
+// stream can't be played this way, in which case decode it in software instead.
+aicastream_t *aicastream_open(unsigned int samplerate, unsigned int channels, int gain);
+
+// How many samples per channel can be written without catching up to the hardware.
+// Must be called at least once per trip around the ring. Returns a negative number
+// if the hardware caught up to us instead, since it will have lost its decoder state
+// playing stale data and the stream can't be recovered.
+int aicastream_space(aicastream_t *stream);
+
+// Queue an even number of samples for every channel, no more than aicastream_space()
+// said there was room for. data[channel] points at two samples a byte, earlier one
+// in the low nibble, continuing the stream where the last write left off.
+void aicastream_write(aicastream_t *stream, const uint8_t **data, unsigned int numsamples);
+
+// Start the hardware once the ring has something in it.
+void aicastream_start(aicastream_t *stream);
+
+// Number of samples per channel the hardware has played since it was started.
+unsigned int aicastream_position(aicastream_t *stream);
+
+// Silence the channels immediately and give them back.
+void aicastream_close(aicastream_t *stream);
+
+#endif
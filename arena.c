@@ -0,0 +1,137 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <naomi/thread.h>
+#include <naomi/interrupt.h>
+#include "arena.h"
+
+// Each allocation is preceded by its size, and everything stays 8 byte aligned
+// so that doubles work.
+#define ARENA_ALIGN 8
+#define ARENA_HEADER ARENA_ALIGN
+#define ARENA_NO_LAST 0xFFFFFFFF
+
+static uint8_t *base = 0;
+static unsigned int top = 0;
+static unsigned int last = ARENA_NO_LAST;
+static unsigned int live = 0;
+static arena_stats_t stats;
+
+static int in_arena(void *ptr)
+{
+    return base != 0 && (uint8_t *)ptr >= base && (uint8_t *)ptr < base + stats.size;
+}
+
+static void *carve(size_t size)
+{
+    size_t need = (size + ARENA_HEADER + (ARENA_ALIGN - 1)) & ~(ARENA_ALIGN - 1);
+    void *ptr = 0;
+
+    if (base == 0 || need < size)
+    {
+        return 0;
+    }
+
+    ATOMIC({
+        if (stats.size - top >= need)
+        {
+            *((uint32_t *)(base + top)) = size;
+            ptr = base + top + ARENA_HEADER;
+            last = top;
+            top += need;
+            live++;
+            stats.used = top;
+            if (top > stats.peak) { stats.peak = top; }
+        }
+        else
+        {
+            stats.fallbacks++;
+        }
+    });
+
+    return ptr;
+}
+
+static void release(void *ptr)
+{
+    // Nothing in the arena is freed individually, except that giving back the most
+    // recent allocation lets the space be reused. Buffers tend to be freed in the
+    // reverse order they were allocated in, so this catches a lot.
+    unsigned int offset = ((uint8_t *)ptr - base) - ARENA_HEADER;
+
+    ATOMIC({
+        live--;
+        if (offset == last)
+        {
+            top = last;
+            last = ARENA_NO_LAST;
+            stats.used = top;
+        }
+    });
+}
+
+void arena_init(unsigned int size)
+{
+    memset(&stats, 0, sizeof(stats));
+    base = malloc(size);
+    stats.size = base ? size : 0;
+}
+
+void arena_begin()
+{
+    ATOMIC({
+        top = 0;
+        last = ARENA_NO_LAST;
+        live = 0;
+        stats.used = 0;
+        stats.peak = 0;
+        stats.sessions++;
+    });
+}
+
+void *arena_alloc(size_t size)
+{
+    void *ptr = carve(size);
+    return ptr ? ptr : malloc(size);
+}
+
+void arena_free(void *ptr)
+{
+    if (ptr == 0)
+    {
+        return;
+    }
+
+    if (in_arena(ptr))
+    {
+        release(ptr);
+    }
+    else
+    {
+        free(ptr);
+    }
+}
+
+unsigned int arena_end()
+{
+    unsigned int peak;
+
+    // Only our own per-session buffers come from here, and they've all been handed
+    // back by now, so it's all free. Count it if something slipped through, since
+    // the next session is about to reuse its memory.
+    ATOMIC({
+        peak = stats.peak;
+        if (live != 0) { stats.leaks += live; }
+        top = 0;
+        last = ARENA_NO_LAST;
+        live = 0;
+        stats.used = 0;
+    });
+
+    return peak;
+}
+
+void arena_get_stats(arena_stats_t *out)
+{
+    ATOMIC(memcpy(out, &stats, sizeof(stats)));
+}
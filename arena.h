@@ -0,0 +1,40 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reserve the memory that every playback session allocates from. Call once at startup.
+void arena_init(unsigned int size);
+
+// Start a new session. Only buffers that we know live exactly as long as the
+// session come from here, such as the session's instructions and the file data
+// a decoder works from. Libraries keep using the heap, since some of what they
+// allocate (stdio buffers, caches and the like) is kept around after a track
+// stops, and that can't be handed to the next session.
+void arena_begin();
+
+// Allocate from the current session, from any thread. Allocations that don't fit
+// fall back to the heap, so everything from here must go back through arena_free().
+void *arena_alloc(size_t size);
+void arena_free(void *ptr);
+
+// Throw away everything allocated during the session at once. Every session buffer
+// must have been freed and every session thread must have exited. Returns the most
+// bytes the session had allocated at any time.
+unsigned int arena_end();
+
+typedef struct
+{
+    unsigned int size;
+    unsigned int used;
+    unsigned int peak;
+    unsigned int sessions;
+    unsigned int fallbacks;
+    // Buffers still allocated when their session ended, which should never happen.
+    unsigned int leaks;
+} arena_stats_t;
+
+void arena_get_stats(arena_stats_t *stats);
+
+#endif
@@ -0,0 +1,251 @@
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <naomi/thread.h>
+#include <naomi/interrupt.h>
+#include "dsp.h"
+
+// Marks the game section of the EEPROM as holding our settings, and which layout.
+#define DSP_SETTINGS_MAGIC 'Q'
+#define DSP_SETTINGS_VERSION 1
+#define DSP_SETTINGS_SIZE (2 + (4 * (DSP_MAX_BANDS + 1)))
+
+// The bass shelf goes first, then the bands.
+static dsp_biquad_t chain[DSP_MAX_BANDS + 1];
+
+void dsp_defaults(dsp_settings_t *settings)
+{
+    static const uint16_t freqs[DSP_MAX_BANDS] = { 250, 1000, 4000, 12000 };
+
+    settings->bass.freq = 100;
+    settings->bass.gain_db = 0;
+    settings->bass.q = 10;
+    for (int i = 0; i < DSP_MAX_BANDS; i++)
+    {
+        settings->bands[i].freq = freqs[i];
+        settings->bands[i].gain_db = 0;
+        settings->bands[i].q = 10;
+    }
+}
+
+static int valid_stage(const dsp_stage_settings_t *stage)
+{
+    return stage->freq >= DSP_MIN_FREQ &&
+        stage->freq <= DSP_MAX_FREQ &&
+        stage->gain_db >= -DSP_MAX_GAIN_DB &&
+        stage->gain_db <= DSP_MAX_GAIN_DB &&
+        stage->q >= DSP_MIN_Q &&
+        stage->q <= DSP_MAX_Q;
+}
+
+static const uint8_t *load_stage(dsp_stage_settings_t *stage, const uint8_t *data)
+{
+    stage->freq = data[0] | (data[1] << 8);
+    stage->gain_db = (int8_t)data[2];
+    stage->q = data[3];
+    return data + 4;
+}
+
+static uint8_t *save_stage(const dsp_stage_settings_t *stage, uint8_t *data)
+{
+    data[0] = stage->freq & 0xFF;
+    data[1] = stage->freq >> 8;
+    data[2] = (uint8_t)stage->gain_db;
+    data[3] = stage->q;
+    return data + 4;
+}
+
+int dsp_load(dsp_settings_t *settings, const uint8_t *data, unsigned int size)
+{
+    if (size < DSP_SETTINGS_SIZE || data[0] != DSP_SETTINGS_MAGIC || data[1] != DSP_SETTINGS_VERSION)
+    {
+        return -1;
+    }
+
+    dsp_settings_t loaded;
+    data = load_stage(&loaded.bass, data + 2);
+    for (int i = 0; i < DSP_MAX_BANDS; i++)
+    {
+        data = load_stage(&loaded.bands[i], data);
+    }
+
+    if (!valid_stage(&loaded.bass))
+    {
+        return -2;
+    }
+    for (int i = 0; i < DSP_MAX_BANDS; i++)
+    {
+        if (!valid_stage(&loaded.bands[i]))
+        {
+            return -2;
+        }
+    }
+
+    memcpy(settings, &loaded, sizeof(loaded));
+    return 0;
+}
+
+int dsp_save(const dsp_settings_t *settings, uint8_t *data, unsigned int size)
+{
+    if (size < DSP_SETTINGS_SIZE)
+    {
+        return -1;
+    }
+
+    data[0] = DSP_SETTINGS_MAGIC;
+    data[1] = DSP_SETTINGS_VERSION;
+    uint8_t *next = save_stage(&settings->bass, data + 2);
+    for (int i = 0; i < DSP_MAX_BANDS; i++)
+    {
+        next = save_stage(&settings->bands[i], next);
+    }
+
+    return DSP_SETTINGS_SIZE;
+}
+
+static void set_coefficients(dsp_biquad_t *biquad, double b0, double b1, double b2, double a0, double a1, double a2)
+{
+    double scale = (double)(1 << DSP_COEFF_SHIFT) / a0;
+    biquad->b0 = (int32_t)lround(b0 * scale);
+    biquad->b1 = (int32_t)lround(b1 * scale);
+    biquad->b2 = (int32_t)lround(b2 * scale);
+    biquad->a1 = (int32_t)lround(a1 * scale);
+    biquad->a2 = (int32_t)lround(a2 * scale);
+}
+
+void dsp_design_low_shelf(dsp_biquad_t *biquad, unsigned int samplerate, unsigned int freq, int gain_db)
+{
+    // Straight out of the Audio EQ Cookbook, with a shelf slope of 1.
+    memset(biquad, 0, sizeof(dsp_biquad_t));
+    biquad->enabled = gain_db != 0;
+
+    double a = pow(10.0, gain_db / 40.0);
+    double w0 = 2.0 * M_PI * freq / samplerate;
+    double cosw0 = cos(w0);
+    double alpha = sin(w0) / 2.0 * sqrt(2.0);
+    double sqrta = 2.0 * sqrt(a) * alpha;
+
+    set_coefficients(
+        biquad,
+        a * ((a + 1.0) - ((a - 1.0) * cosw0) + sqrta),
+        2.0 * a * ((a - 1.0) - ((a + 1.0) * cosw0)),
+        a * ((a + 1.0) - ((a - 1.0) * cosw0) - sqrta),
+        (a + 1.0) + ((a - 1.0) * cosw0) + sqrta,
+        -2.0 * ((a - 1.0) + ((a + 1.0) * cosw0)),
+        (a + 1.0) + ((a - 1.0) * cosw0) - sqrta
+    );
+}
+
+void dsp_design_peaking(dsp_biquad_t *biquad, unsigned int samplerate, unsigned int freq, int gain_db, unsigned int q)
+{
+    memset(biquad, 0, sizeof(dsp_biquad_t));
+    biquad->enabled = gain_db != 0;
+
+    double a = pow(10.0, gain_db / 40.0);
+    double w0 = 2.0 * M_PI * freq / samplerate;
+    double cosw0 = cos(w0);
+    double alpha = sin(w0) / (2.0 * (q / 10.0));
+
+    set_coefficients(
+        biquad,
+        1.0 + (alpha * a),
+        -2.0 * cosw0,
+        1.0 - (alpha * a),
+        1.0 + (alpha / a),
+        -2.0 * cosw0,
+        1.0 - (alpha / a)
+    );
+}
+
+void dsp_configure(const dsp_settings_t *settings, unsigned int samplerate)
+{
+    static dsp_biquad_t designed[DSP_MAX_BANDS + 1];
+
+    // Anything past Nyquist can't be designed, so clamp it to just under.
+    unsigned int maxfreq = (samplerate / 2) - 1;
+    dsp_design_low_shelf(&designed[0], samplerate, settings->bass.freq > maxfreq ? maxfreq : settings->bass.freq, settings->bass.gain_db);
+    for (int i = 0; i < DSP_MAX_BANDS; i++)
+    {
+        const dsp_stage_settings_t *band = &settings->bands[i];
+        dsp_design_peaking(&designed[i + 1], samplerate, band->freq > maxfreq ? maxfreq : band->freq, band->gain_db, band->q);
+    }
+
+    // Swap the coefficients in between blocks. Stages that were already running keep
+    // their history so changing settings while music plays doesn't click.
+    ATOMIC({
+        for (int i = 0; i < DSP_MAX_BANDS + 1; i++)
+        {
+            if (chain[i].enabled && designed[i].enabled)
+            {
+                chain[i].b0 = designed[i].b0;
+                chain[i].b1 = designed[i].b1;
+                chain[i].b2 = designed[i].b2;
+                chain[i].a1 = designed[i].a1;
+                chain[i].a2 = designed[i].a2;
+            }
+            else
+            {
+                memcpy(&chain[i], &designed[i], sizeof(dsp_biquad_t));
+            }
+        }
+    });
+}
+
+void dsp_kernel_biquad(dsp_biquad_t *biquad, int32_t *samples, unsigned int numsamples)
+{
+    // Direct form I, with the fractional part of each output fed back into the next
+    // so that low shelves don't turn rounding into audible noise.
+    const int32_t b0 = biquad->b0;
+    const int32_t b1 = biquad->b1;
+    const int32_t b2 = biquad->b2;
+    const int32_t a1 = biquad->a1;
+    const int32_t a2 = biquad->a2;
+    const int64_t mask = (1 << DSP_COEFF_SHIFT) - 1;
+
+    for (int channel = 0; channel < 2; channel++)
+    {
+        int32_t x1 = biquad->x1[channel];
+        int32_t x2 = biquad->x2[channel];
+        int32_t y1 = biquad->y1[channel];
+        int32_t y2 = biquad->y2[channel];
+        int64_t error = biquad->error[channel];
+        int32_t *sample = samples + channel;
+
+        for (unsigned int i = 0; i < numsamples; i++)
+        {
+            int32_t x0 = *sample;
+            int64_t acc = error +
+                ((int64_t)b0 * x0) +
+                ((int64_t)b1 * x1) +
+                ((int64_t)b2 * x2) -
+                ((int64_t)a1 * y1) -
+                ((int64_t)a2 * y2);
+            int32_t y0 = (int32_t)(acc >> DSP_COEFF_SHIFT);
+            error = acc & mask;
+
+            x2 = x1;
+            x1 = x0;
+            y2 = y1;
+            y1 = y0;
+            *sample = y0;
+            sample += 2;
+        }
+
+        biquad->x1[channel] = x1;
+        biquad->x2[channel] = x2;
+        biquad->y1[channel] = y1;
+        biquad->y2[channel] = y2;
+        biquad->error[channel] = (int32_t)error;
+    }
+}
+
+void dsp_process(int32_t *samples, unsigned int numsamples)
+{
+    for (int i = 0; i < DSP_MAX_BANDS + 1; i++)
+    {
+        if (chain[i].enabled)
+        {
+            dsp_kernel_biquad(&chain[i], samples, numsamples);
+        }
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef __DSP_H
+#define __DSP_H
+
+#include <stdint.h>
+
+// Number of peaking EQ bands, on top of the bass shelf.
+#define DSP_MAX_BANDS 4
+
+// Limits on what a single stage can be set to. Gains are in dB, and widths are Q
+// in tenths.
+#define DSP_MAX_GAIN_DB 12
+#define DSP_MIN_FREQ 20
+#define DSP_MAX_FREQ 20000
+#define DSP_MIN_Q 1
+#define DSP_MAX_Q 100
+
+// Filter coefficients are 4.28 fixed point.
+#define DSP_COEFF_SHIFT 28
+
+typedef struct
+{
+    int32_t b0;
+    int32_t b1;
+    int32_t b2;
+    int32_t a1;
+    int32_t a2;
+
+    // Previous inputs and outputs for each channel, and the rounding error we carry
+    // back into the next output so quantization doesn't build up in the feedback.
+    int32_t x1[2];
+    int32_t x2[2];
+    int32_t y1[2];
+    int32_t y2[2];
+    int32_t error[2];
+
+    // Flat stages are skipped entirely.
+    int enabled;
+} dsp_biquad_t;
+
+typedef struct
+{
+    uint16_t freq;
+    int8_t gain_db;
+    // Width of a peaking band, Q in tenths. Unused for the shelf.
+    uint8_t q;
+} dsp_stage_settings_t;
+
+typedef struct
+{
+    dsp_stage_settings_t bass;
+    dsp_stage_settings_t bands[DSP_MAX_BANDS];
+} dsp_settings_t;
+
+// Settings that leave the audio untouched.
+void dsp_defaults(dsp_settings_t *settings);
+
+// Read and write settings in the game section of the EEPROM. Load returns 0 if
+// valid settings were found, and save returns how many bytes it used, or a
+// negative number if they don't fit.
+int dsp_load(dsp_settings_t *settings, const uint8_t *data, unsigned int size);
+int dsp_save(const dsp_settings_t *settings, uint8_t *data, unsigned int size);
+
+// Design filters for new settings and swap them into the chain the mixer runs.
+void dsp_configure(const dsp_settings_t *settings, unsigned int samplerate);
+
+// Run the configured chain over a block of interleaved stereo samples in place.
+void dsp_process(int32_t *samples, unsigned int numsamples);
+
+// Filter design and the kernel itself, exposed so that test mode can benchmark them.
+void dsp_design_low_shelf(dsp_biquad_t *biquad, unsigned int samplerate, unsigned int freq, int gain_db);
+void dsp_design_peaking(dsp_biquad_t *biquad, unsigned int samplerate, unsigned int freq, int gain_db, unsigned int q);
+void dsp_kernel_biquad(dsp_biquad_t *biquad, int32_t *samples, unsigned int numsamples);
+
+#endif
@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <naomi/thread.h>
+#include <naomi/interrupt.h>
+#include "eventlog.h"
+
+static char lines[EVENTLOG_LINES][EVENTLOG_LINE_LENGTH];
+static unsigned int count = 0;
+
+void eventlog_printf(const char *fmt, ...)
+{
+    char line[EVENTLOG_LINE_LENGTH];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    ATOMIC({
+        strcpy(lines[count % EVENTLOG_LINES], line);
+        count++;
+    });
+}
+
+int eventlog_get(int index, char *out)
+{
+    int retval = -1;
+
+    ATOMIC({
+        unsigned int available = count < EVENTLOG_LINES ? count : EVENTLOG_LINES;
+        if (index >= 0 && index < available)
+        {
+            strcpy(out, lines[(count - available + index) % EVENTLOG_LINES]);
+            retval = 0;
+        }
+    });
+
+    return retval;
+}
@@ -0,0 +1,17 @@
+#ifndef __EVENTLOG_H
+#define __EVENTLOG_H
+
+// Number of most recent messages we remember.
+#define EVENTLOG_LINES 8
+
+// Longest message we keep, anything longer is truncated.
+#define EVENTLOG_LINE_LENGTH 72
+
+// Log a message from any thread so it can be shown on the statistics page.
+void eventlog_printf(const char *fmt, ...);
+
+// Copy out a logged message, where 0 is the oldest we still have. Returns nonzero
+// if there is no message at that index.
+int eventlog_get(int index, char *out);
+
+#endif
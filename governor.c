@@ -0,0 +1,55 @@
+#include <string.h>
+#include "governor.h"
+
+void governor_init(governor_t *governor, int max_level)
+{
+    memset(governor, 0, sizeof(governor_t));
+    governor->max_level = max_level;
+    governor->restore_updates = GOVERNOR_RESTORE_UPDATES;
+    governor->since_restore = GOVERNOR_RESTORE_UPDATES_MAX;
+}
+
+int governor_update(governor_t *governor, unsigned int elapsed_us, unsigned int budget_us)
+{
+    if (budget_us == 0)
+    {
+        return 0;
+    }
+
+    unsigned int load = (elapsed_us * 100) / budget_us;
+    governor->load = ((governor->load * 7) + load + 4) / 8;
+    governor->last_elapsed_us = elapsed_us;
+    governor->last_budget_us = budget_us;
+    if (governor->since_restore < GOVERNOR_RESTORE_UPDATES_MAX)
+    {
+        governor->since_restore++;
+    }
+
+    governor->over = governor->load > GOVERNOR_HIGH_LOAD ? governor->over + 1 : 0;
+    governor->under = governor->load < GOVERNOR_LOW_LOAD ? governor->under + 1 : 0;
+
+    if (governor->over >= GOVERNOR_DEGRADE_UPDATES && governor->level < governor->max_level)
+    {
+        // If we only just came back up to this level, be more patient next time.
+        if (governor->since_restore < governor->restore_updates && governor->restore_updates < GOVERNOR_RESTORE_UPDATES_MAX)
+        {
+            governor->restore_updates *= 2;
+        }
+
+        governor->level++;
+        governor->over = 0;
+        governor->under = 0;
+        return 1;
+    }
+
+    if (governor->under >= governor->restore_updates && governor->level > 0)
+    {
+        governor->level--;
+        governor->over = 0;
+        governor->under = 0;
+        governor->since_restore = 0;
+        return -1;
+    }
+
+    return 0;
+}
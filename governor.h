@@ -0,0 +1,43 @@
+#ifndef __GOVERNOR_H
+#define __GOVERNOR_H
+
+// Smoothed load, as a percentage of the real-time budget, above which we degrade.
+#define GOVERNOR_HIGH_LOAD 85
+
+// Smoothed load below which we consider going back up in quality.
+#define GOVERNOR_LOW_LOAD 50
+
+// How many consecutive overloaded updates it takes to degrade.
+#define GOVERNOR_DEGRADE_UPDATES 4
+
+// How many consecutive idle updates it takes to restore quality. This doubles each
+// time a restore has to be undone quickly, so we don't flap between two levels.
+#define GOVERNOR_RESTORE_UPDATES 200
+#define GOVERNOR_RESTORE_UPDATES_MAX 3200
+
+typedef struct
+{
+    // 0 is best quality, max_level is the cheapest we can go.
+    int level;
+    int max_level;
+
+    // Exponentially smoothed load in percent, and the last raw measurement.
+    unsigned int load;
+    unsigned int last_elapsed_us;
+    unsigned int last_budget_us;
+
+    int over;
+    int under;
+    int restore_updates;
+    int since_restore;
+} governor_t;
+
+void governor_init(governor_t *governor, int max_level);
+
+// Feed how long it took to render a chunk of audio against how long that audio
+// takes to play. Returns 1 if the caller should drop one quality level, -1 if it
+// should go back up one, and 0 if it should keep going as-is. The new level is
+// already reflected in governor->level when this returns.
+int governor_update(governor_t *governor, unsigned int elapsed_us, unsigned int budget_us);
+
+#endif
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "loudness.h"
+#include "mixer.h"
+#include "lz4file.h"
+#include "adpcm.h"
+
+typedef struct
+{
+    char path[256];
+    int gain;
+    unsigned int peak;
+} loudness_entry_t;
+
+static loudness_entry_t *entries = 0;
+static unsigned int count = 0;
+
+static int has_suffix(const char *filename, int namelen, const char *suffix)
+{
+    int suffixlen = strlen(suffix);
+    return namelen > suffixlen && strncmp(filename + (namelen - suffixlen), suffix, suffixlen) == 0;
+}
+
+void loudness_init(const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if (fp == 0)
+    {
+        // Nothing was measured, so everything plays as-is.
+        return;
+    }
+
+    char line[300];
+    while (fgets(line, sizeof(line), fp) != 0)
+    {
+        loudness_entry_t entry;
+        memset(&entry, 0, sizeof(entry));
+        if (sscanf(line, "%d %u %255[^\r\n]", &entry.gain, &entry.peak, entry.path) != 3 || entry.gain <= 0)
+        {
+            continue;
+        }
+
+        loudness_entry_t *grown = realloc(entries, sizeof(loudness_entry_t) * (count + 1));
+        if (grown == 0)
+        {
+            break;
+        }
+
+        entries = grown;
+        entries[count++] = entry;
+    }
+
+    fclose(fp);
+}
+
+int loudness_lookup(const char *filename, unsigned int *peak)
+{
+    // The table is keyed on the path the track had in romfs/, so drop the mount
+    // point and anything our build tools appended.
+    if (strncmp(filename, "rom://", 6) == 0)
+    {
+        filename += 6;
+    }
+    while (filename[0] == '/')
+    {
+        filename++;
+    }
+
+    int namelen = strlen(filename);
+    if (has_suffix(filename, namelen, LZ4FILE_SUFFIX))
+    {
+        namelen -= strlen(LZ4FILE_SUFFIX);
+    }
+    else if (has_suffix(filename, namelen, ADPCM_SUFFIX))
+    {
+        namelen -= strlen(ADPCM_SUFFIX);
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (strncmp(entries[i].path, filename, namelen) == 0 && entries[i].path[namelen] == 0)
+        {
+            if (peak)
+            {
+                *peak = entries[i].peak;
+            }
+            return entries[i].gain;
+        }
+    }
+
+    if (peak)
+    {
+        *peak = 0;
+    }
+    return MIXER_UNITY_GAIN;
+}
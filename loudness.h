@@ -0,0 +1,14 @@
+#ifndef __LOUDNESS_H
+#define __LOUDNESS_H
+
+// Table of per-track gains written by tools/loudness_scan.py at build time.
+#define LOUDNESS_TABLE "rom://loudness.txt"
+
+// Load the gain table, if the ROM FS has one. Call once at startup.
+void loudness_init(const char *filename);
+
+// Look up the 4.12 fixed point gain that brings a track to the common loudness, and
+// optionally its peak sample. Tracks that weren't measured get unity gain.
+int loudness_lookup(const char *filename, unsigned int *peak);
+
+#endif
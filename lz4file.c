@@ -0,0 +1,518 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <naomi/posix.h>
+#include <naomi/thread.h>
+#include <naomi/interrupt.h>
+#include <naomi/timer.h>
+#include "lz4file.h"
+
+typedef struct
+{
+    int block;
+    unsigned int length;
+    unsigned int lastused;
+    uint8_t *data;
+} lz4file_block_t;
+
+struct lz4file
+{
+    FILE *fp;
+    unsigned int size;
+    unsigned int blocksize;
+    unsigned int blockcount;
+    uint32_t *offsets;
+    long dataoffset;
+    unsigned int position;
+    unsigned int usecount;
+
+    // Staging area for compressed data, and our small cache of decompressed blocks.
+    uint8_t *compressed;
+    lz4file_block_t cache[LZ4FILE_CACHED_BLOCKS];
+};
+
+static lz4file_stats_t stats;
+
+static uint32_t read_le32(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+int lz4file_is_compressed(const char *filename)
+{
+    int namelen = strlen(filename);
+    int suffixlen = strlen(LZ4FILE_SUFFIX);
+
+    return namelen > suffixlen && strcmp(filename + (namelen - suffixlen), LZ4FILE_SUFFIX) == 0;
+}
+
+int lz4_decompress_block(const uint8_t *src, unsigned int srclen, uint8_t *dst, unsigned int dstlen)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + srclen;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dstlen;
+
+    while (ip < iend)
+    {
+        unsigned int token = *ip++;
+
+        // Literal run.
+        unsigned int length = token >> 4;
+        if (length == 15)
+        {
+            unsigned int extra;
+            do
+            {
+                if (ip >= iend) { return -1; }
+                extra = *ip++;
+                length += extra;
+            } while (extra == 255);
+        }
+        if (length > (unsigned int)(iend - ip) || length > (unsigned int)(oend - op)) { return -1; }
+        memcpy(op, ip, length);
+        ip += length;
+        op += length;
+
+        // The last sequence is literals only.
+        if (ip >= iend)
+        {
+            break;
+        }
+
+        // Match copy.
+        if ((iend - ip) < 2) { return -1; }
+        unsigned int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (unsigned int)(op - dst)) { return -1; }
+
+        length = (token & 0xF) + 4;
+        if ((token & 0xF) == 15)
+        {
+            unsigned int extra;
+            do
+            {
+                if (ip >= iend) { return -1; }
+                extra = *ip++;
+                length += extra;
+            } while (extra == 255);
+        }
+        if (length > (unsigned int)(oend - op)) { return -1; }
+
+        // Matches can overlap their own output, so this has to go a byte at a time
+        // unless the source is far enough back.
+        const uint8_t *match = op - offset;
+        if (offset >= length)
+        {
+            memcpy(op, match, length);
+            op += length;
+        }
+        else
+        {
+            while (length--) { *op++ = *match++; }
+        }
+    }
+
+    return op - dst;
+}
+
+lz4file_t *lz4file_open(const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == 0)
+    {
+        return 0;
+    }
+
+    uint8_t header[16];
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, "LZ4B", 4) != 0)
+    {
+        fclose(fp);
+        return 0;
+    }
+
+    // Make sure the header describes a file that could actually be this one before
+    // sizing anything off of it.
+    uint32_t size = read_le32(header + 4);
+    uint32_t blocksize = read_le32(header + 8);
+    uint32_t blockcount = read_le32(header + 12);
+    fseek(fp, 0, SEEK_END);
+    long filesize = ftell(fp);
+    fseek(fp, sizeof(header), SEEK_SET);
+
+    uint64_t tableend = sizeof(header) + (sizeof(uint32_t) * ((uint64_t)blockcount + 1));
+    if (blocksize == 0 || blockcount != ((uint64_t)size + blocksize - 1) / blocksize || filesize < 0 || tableend > (uint64_t)filesize)
+    {
+        fclose(fp);
+        return 0;
+    }
+
+    lz4file_t *file = malloc(sizeof(lz4file_t));
+    if (file == 0)
+    {
+        fclose(fp);
+        return 0;
+    }
+
+    memset(file, 0, sizeof(lz4file_t));
+    file->fp = fp;
+    file->size = size;
+    file->blocksize = blocksize;
+    file->blockcount = blockcount;
+    file->offsets = malloc(sizeof(uint32_t) * (file->blockcount + 1));
+    file->compressed = malloc(file->blocksize);
+    file->dataoffset = sizeof(header) + (sizeof(uint32_t) * (file->blockcount + 1));
+
+    int ok = file->offsets != 0 && file->compressed != 0;
+    for (unsigned int i = 0; ok && i <= file->blockcount; i++)
+    {
+        uint8_t offset[4];
+        if (fread(offset, 1, sizeof(offset), fp) != sizeof(offset))
+        {
+            ok = 0;
+            break;
+        }
+
+        file->offsets[i] = read_le32(offset);
+        if (i > 0 && (file->offsets[i] < file->offsets[i - 1] || (file->offsets[i] - file->offsets[i - 1]) > file->blocksize))
+        {
+            ok = 0;
+        }
+    }
+
+    // The last offset is where the compressed data ends, which has to be in the file.
+    if (ok && file->dataoffset + (uint64_t)file->offsets[file->blockcount] > (uint64_t)filesize)
+    {
+        ok = 0;
+    }
+
+    for (int i = 0; ok && i < LZ4FILE_CACHED_BLOCKS; i++)
+    {
+        file->cache[i].block = -1;
+        file->cache[i].data = malloc(file->blocksize);
+        ok = file->cache[i].data != 0;
+    }
+
+    if (!ok)
+    {
+        lz4file_close(file);
+        return 0;
+    }
+
+    return file;
+}
+
+void lz4file_close(lz4file_t *file)
+{
+    for (int i = 0; i < LZ4FILE_CACHED_BLOCKS; i++)
+    {
+        free(file->cache[i].data);
+    }
+
+    free(file->compressed);
+    free(file->offsets);
+    fclose(file->fp);
+    free(file);
+}
+
+static lz4file_block_t *get_block(lz4file_t *file, unsigned int block)
+{
+    // Most reads are sequential, so usually the block is already here.
+    lz4file_block_t *victim = &file->cache[0];
+    for (int i = 0; i < LZ4FILE_CACHED_BLOCKS; i++)
+    {
+        if (file->cache[i].block == (int)block)
+        {
+            file->cache[i].lastused = ++file->usecount;
+            ATOMIC(stats.cache_hits++);
+            return &file->cache[i];
+        }
+        if (file->cache[i].lastused < victim->lastused)
+        {
+            victim = &file->cache[i];
+        }
+    }
+
+    unsigned int expected = file->size - (block * file->blocksize);
+    if (expected > file->blocksize) { expected = file->blocksize; }
+    unsigned int stored = file->offsets[block + 1] - file->offsets[block];
+
+    victim->block = -1;
+    if (fseek(file->fp, file->dataoffset + file->offsets[block], SEEK_SET) != 0)
+    {
+        return 0;
+    }
+
+    int profile = profile_start();
+    if (stored == expected)
+    {
+        // Stored uncompressed since it didn't shrink.
+        if (fread(victim->data, 1, stored, file->fp) != stored)
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        if (fread(file->compressed, 1, stored, file->fp) != stored)
+        {
+            return 0;
+        }
+        if (lz4_decompress_block(file->compressed, stored, victim->data, expected) != expected)
+        {
+            return 0;
+        }
+    }
+    uint32_t elapsed = profile_end(profile);
+
+    ATOMIC({
+        stats.blocks_decompressed++;
+        stats.compressed_bytes += stored;
+        stats.decompressed_bytes += expected;
+        stats.decompress_us += elapsed;
+    });
+
+    victim->block = block;
+    victim->length = expected;
+    victim->lastused = ++file->usecount;
+    return victim;
+}
+
+int lz4file_read(lz4file_t *file, void *ptr, unsigned int size)
+{
+    uint8_t *out = (uint8_t *)ptr;
+    unsigned int total = 0;
+
+    while (size > 0 && file->position < file->size)
+    {
+        lz4file_block_t *block = get_block(file, file->position / file->blocksize);
+        if (block == 0)
+        {
+            return total > 0 ? total : -1;
+        }
+
+        unsigned int offset = file->position % file->blocksize;
+        unsigned int amount = block->length - offset;
+        if (amount > size) { amount = size; }
+
+        memcpy(out, block->data + offset, amount);
+        out += amount;
+        total += amount;
+        size -= amount;
+        file->position += amount;
+    }
+
+    return total;
+}
+
+int lz4file_seek(lz4file_t *file, long offset, int whence)
+{
+    long position;
+    switch (whence)
+    {
+        case SEEK_SET:
+            position = offset;
+            break;
+        case SEEK_CUR:
+            position = (long)file->position + offset;
+            break;
+        case SEEK_END:
+            position = (long)file->size + offset;
+            break;
+        default:
+            return -1;
+    }
+
+    if (position < 0)
+    {
+        return -1;
+    }
+
+    file->position = position > file->size ? file->size : position;
+    return 0;
+}
+
+long lz4file_tell(lz4file_t *file)
+{
+    return file->position;
+}
+
+unsigned int lz4file_size(lz4file_t *file)
+{
+    return file->size;
+}
+
+void lz4file_get_stats(lz4file_stats_t *out)
+{
+    ATOMIC(memcpy(out, &stats, sizeof(stats)));
+}
+
+// Files opened through LZ4FILE_PREFIX are either compressed ones, which we unpack
+// through the block cache, or ones that were left alone, which we pass straight through.
+typedef struct
+{
+    lz4file_t *lz4;
+    FILE *fp;
+} lz4fs_file_t;
+
+static void *lz4fs_open(void *fshandle, const char *filename, int flags, int mode)
+{
+    char path[1024];
+
+    if ((flags & O_ACCMODE) != O_RDONLY)
+    {
+        return (void *)-EROFS;
+    }
+    if (strlen(LZ4FILE_ROOT) + strlen(filename) + strlen(LZ4FILE_SUFFIX) >= sizeof(path))
+    {
+        return (void *)-ENAMETOOLONG;
+    }
+
+    lz4fs_file_t *file = malloc(sizeof(lz4fs_file_t));
+    if (file == 0)
+    {
+        return (void *)-ENOMEM;
+    }
+
+    strcpy(path, LZ4FILE_ROOT);
+    strcat(path, filename);
+    strcat(path, LZ4FILE_SUFFIX);
+    file->lz4 = lz4file_open(path);
+    file->fp = 0;
+
+    if (file->lz4 == 0)
+    {
+        path[strlen(path) - strlen(LZ4FILE_SUFFIX)] = 0;
+        file->fp = fopen(path, "rb");
+        if (file->fp == 0)
+        {
+            free(file);
+            return (void *)-ENOENT;
+        }
+    }
+
+    return file;
+}
+
+static int lz4fs_fstat(void *fshandle, void *handle, struct stat *st)
+{
+    lz4fs_file_t *file = (lz4fs_file_t *)handle;
+
+    if (file->lz4 == 0)
+    {
+        return fstat(fileno(file->fp), st);
+    }
+
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = S_IFREG | 0444;
+    st->st_size = lz4file_size(file->lz4);
+    st->st_nlink = 1;
+    return 0;
+}
+
+static int lz4fs_lseek(void *fshandle, void *handle, int offset, int whence)
+{
+    lz4fs_file_t *file = (lz4fs_file_t *)handle;
+
+    if (file->lz4 == 0)
+    {
+        if (fseek(file->fp, offset, whence) != 0)
+        {
+            return -EINVAL;
+        }
+        return ftell(file->fp);
+    }
+
+    if (lz4file_seek(file->lz4, offset, whence) != 0)
+    {
+        return -EINVAL;
+    }
+    return lz4file_tell(file->lz4);
+}
+
+static int lz4fs_read(void *fshandle, void *handle, void *ptr, int len)
+{
+    lz4fs_file_t *file = (lz4fs_file_t *)handle;
+
+    if (len <= 0)
+    {
+        return 0;
+    }
+    if (file->lz4 == 0)
+    {
+        return fread(ptr, 1, len, file->fp);
+    }
+
+    int amount = lz4file_read(file->lz4, ptr, len);
+    return amount < 0 ? -EIO : amount;
+}
+
+static int lz4fs_close(void *fshandle, void *handle)
+{
+    lz4fs_file_t *file = (lz4fs_file_t *)handle;
+
+    if (file->lz4)
+    {
+        lz4file_close(file->lz4);
+    }
+    else
+    {
+        fclose(file->fp);
+    }
+
+    free(file);
+    return 0;
+}
+
+static int lz4fs_stat(void *fshandle, const char *path, struct stat *st)
+{
+    void *handle = lz4fs_open(fshandle, path, O_RDONLY, 0);
+    if ((intptr_t)handle < 0)
+    {
+        return (intptr_t)handle;
+    }
+
+    int retval = lz4fs_fstat(fshandle, handle, st);
+    lz4fs_close(fshandle, handle);
+    return retval;
+}
+
+static filesystem_t lz4fs = {
+    .open = lz4fs_open,
+    .fstat = lz4fs_fstat,
+    .lseek = lz4fs_lseek,
+    .read = lz4fs_read,
+    .close = lz4fs_close,
+    .stat = lz4fs_stat,
+};
+
+int lz4file_mount()
+{
+    return attach_filesystem(LZ4FILE_PREFIX, &lz4fs, 0);
+}
+
+void lz4file_mounted_name(const char *filename, char *out, unsigned int outlen)
+{
+    int rootlen = strlen(LZ4FILE_ROOT);
+    int namelen = strlen(filename);
+
+    out[0] = 0;
+    if (lz4file_is_compressed(filename) && strncmp(filename, LZ4FILE_ROOT, rootlen) == 0)
+    {
+        // Same file, minus the compression suffix, under our prefix instead of the ROMFS one.
+        namelen -= rootlen + strlen(LZ4FILE_SUFFIX);
+        if (strlen(LZ4FILE_PREFIX) + namelen < outlen)
+        {
+            strcpy(out, LZ4FILE_PREFIX);
+            strncat(out, filename + rootlen, namelen);
+        }
+    }
+    else if (namelen < outlen)
+    {
+        strcpy(out, filename);
+    }
+}
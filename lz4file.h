@@ -0,0 +1,58 @@
+#ifndef __LZ4FILE_H
+#define __LZ4FILE_H
+
+#include <stdint.h>
+
+// Suffix tools/romfs_compress.py appends to files it compressed.
+#define LZ4FILE_SUFFIX ".lz4"
+
+// Where compressed files live, and the prefix lz4file_mount() serves them from
+// under their original names.
+#define LZ4FILE_ROOT "rom://"
+#define LZ4FILE_PREFIX "lz4://"
+
+// How many decompressed blocks each open file keeps around.
+#define LZ4FILE_CACHED_BLOCKS 4
+
+typedef struct lz4file lz4file_t;
+
+// Returns nonzero if this is a file that was compressed at build time.
+int lz4file_is_compressed(const char *filename);
+
+// Open a compressed file for random access reads, or return 0 on failure.
+lz4file_t *lz4file_open(const char *filename);
+void lz4file_close(lz4file_t *file);
+
+// These behave like fread(), fseek(), ftell() on the original uncompressed data.
+int lz4file_read(lz4file_t *file, void *ptr, unsigned int size);
+int lz4file_seek(lz4file_t *file, long offset, int whence);
+long lz4file_tell(lz4file_t *file);
+unsigned int lz4file_size(lz4file_t *file);
+
+// Attach LZ4FILE_PREFIX to the filesystem, so that libraries which only take a path
+// can open, seek and read a compressed file through the block cache as if it were
+// the original. Files that weren't compressed are passed through unchanged, so
+// something like timidity's patch directory can point here whether or not its
+// patches were compressed. Call once after the ROMFS is up.
+int lz4file_mount();
+
+// Work out the name to open a ROMFS file by. Compressed files get their name under
+// LZ4FILE_PREFIX, anything else is copied as is.
+void lz4file_mounted_name(const char *filename, char *out, unsigned int outlen);
+
+// Decompress an LZ4 block. Returns the number of bytes produced or a negative
+// number if the input is corrupt or would overflow the output.
+int lz4_decompress_block(const uint8_t *src, unsigned int srclen, uint8_t *dst, unsigned int dstlen);
+
+typedef struct
+{
+    unsigned int blocks_decompressed;
+    unsigned int cache_hits;
+    unsigned int compressed_bytes;
+    unsigned int decompressed_bytes;
+    unsigned int decompress_us;
+} lz4file_stats_t;
+
+void lz4file_get_stats(lz4file_stats_t *stats);
+
+#endif
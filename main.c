@@ -3,6 +3,8 @@
 #include <string.h>
 #include <dirent.h>
 #include <stdlib.h>
+#include <malloc.h>
+#include <math.h>
 #include <naomi/video.h>
 #include <naomi/audio.h>
 #include <naomi/maple.h>
@@ -16,28 +18,221 @@
 #include <mpg123.h>
 #include <vorbis/codec.h>
 #include <vorbis/vorbisfile.h>
+#include "pcmcache.h"
+#include "mixer.h"
+#include "governor.h"
+#include "eventlog.h"
+#include "midifilter.h"
+#include "lz4file.h"
+#include "arena.h"
+#include "adpcm.h"
+#include "aicastream.h"
+#include "loudness.h"
+#include "dsp.h"
+#include "wsola.h"
 
 #define BUFSIZE 8192
-#define SAMPLERATE 44100
+#define SAMPLERATE MIXER_SAMPLERATE
+
+// How much RAM we're willing to spend keeping decoded audio of recently played
+// tracks around so they can be replayed without decoding. Set to 0 to disable.
+#define PCMCACHE_BUDGET (8 * 1024 * 1024)
+
+// Store cached audio as ADPCM instead of 16-bit PCM. It costs a little quality, but
+// a quarter of the memory means the budget holds over three minutes of 44.1kHz
+// stereo instead of under one, which is the difference between caching whole
+// tracks and caching hardly any.
+#define PCMCACHE_ADPCM 1
+
+// Memory set aside for the buffers a playback session allocates itself, such as
+// whole MIDI files. It is all thrown away at once when the track stops,
+// so weeks of playing tracks can't fragment the heap with them.
+#define ARENA_SIZE (8 * 1024 * 1024)
+
+// Look up titles and durations on a low priority thread once playback has started,
+// instead of making the listener wait for them. Set to 0 to do it up front for comparison.
+#define DEFER_METADATA 1
+
+// Stream pre-rendered tracks to a sound channel for the AICA to decode in hardware.
+// Set to 0 to decode them in software and play them through the mixer, which is
+// also what happens if the hardware can't take them. Tempo, pitch and EQ only apply
+// to tracks that go through the mixer.
+#define ADPCM_HARDWARE 1
 
 typedef struct
 {
     char filename[1024];
+    // What decoders open, which for files compressed at build time is their name on
+    // the lz4:// filesystem so that they're unpacked as they're read.
+    char path[1024];
     char modulename[128];
     char tracker[128];
     char position[128];
     volatile int exit;
     volatile int error;
     uint32_t thread;
+    pcmcache_entry_t *cached;
+
+    // Gain that brings this track to the same loudness as the others, and its peak.
+    int gain;
+    unsigned int peak;
+
+    // Length of the track in seconds, or -1 until somebody has worked it out.
+    volatile int duration;
+    uint32_t metathread;
+    int metadata_pending;
+
+    // Which format this is, and the profile we use to time how long until it is heard.
+    int format;
+    int ttfs_profile;
+    int ttfs_done;
 } audiothread_instructions_t;
 
+enum
+{
+    FORMAT_MODULE,
+    FORMAT_MIDI,
+    FORMAT_MP3,
+    FORMAT_OGG,
+    FORMAT_ADPCM,
+    FORMAT_CACHED,
+    FORMAT_COUNT,
+};
+
+static const char *format_names[FORMAT_COUNT] = { "module", "midi", "mp3", "ogg", "adpcm", "cached" };
+
+typedef struct
+{
+    unsigned int last_us;
+    unsigned int total_us;
+    unsigned int count;
+} ttfs_stats_t;
+
+ttfs_stats_t ttfs_stats[FORMAT_COUNT];
+
+// Most session arena memory a track of each format has needed.
+unsigned int arena_peak[FORMAT_COUNT];
+
+// Heap in use once a track has stopped, which should stay flat no matter how long
+// the cabinet has been running.
+typedef struct
+{
+    unsigned int last;
+    unsigned int peak;
+} heap_stats_t;
+
+heap_stats_t heap_stats;
+
+void first_sample(audiothread_instructions_t *instructions)
+{
+    // Record how long it took from asking for this file to handing its first
+    // decoded audio to the mixer.
+    if (instructions->ttfs_done)
+    {
+        return;
+    }
+
+    instructions->ttfs_done = 1;
+    uint32_t elapsed = profile_end(instructions->ttfs_profile);
+    ATOMIC({
+        ttfs_stats[instructions->format].last_us = elapsed;
+        ttfs_stats[instructions->format].total_us += elapsed;
+        ttfs_stats[instructions->format].count++;
+    });
+}
+
+void metadata_start(audiothread_instructions_t *instructions, void *(*func)(void *))
+{
+#if DEFER_METADATA
+    // Lower priority than any decoder, so it only runs when they're waiting on the mixer.
+    instructions->metathread = thread_create("metadata", func, instructions);
+    instructions->metadata_pending = 1;
+    thread_priority(instructions->metathread, 0);
+    thread_start(instructions->metathread);
+#else
+    func(instructions);
+#endif
+}
+
+void metadata_finish(audiothread_instructions_t *instructions)
+{
+    // Must be called before tearing down anything the metadata thread might be using.
+    if (instructions->metadata_pending)
+    {
+        thread_join(instructions->metathread);
+        thread_destroy(instructions->metathread);
+        instructions->metadata_pending = 0;
+    }
+}
+
+void publish_position(audiothread_instructions_t *instructions, unsigned int seconds)
+{
+    int duration = instructions->duration;
+    if (duration < 0)
+    {
+        ATOMIC(sprintf(instructions->position, "%u/?", seconds));
+    }
+    else
+    {
+        ATOMIC(sprintf(instructions->position, "%u/%d", seconds, duration));
+    }
+}
+
+uint8_t *read_file(const char *filename, unsigned int *size)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == 0)
+    {
+        return 0;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    uint8_t *data = length > 0 ? arena_alloc(length) : 0;
+    if (data != 0 && fread(data, 1, length, fp) != length)
+    {
+        arena_free(data);
+        data = 0;
+    }
+
+    fclose(fp);
+    *size = length;
+    return data;
+}
+
+// Rendering quality steps for libxmp, best first. The governor walks down this
+// list when rendering can't keep up and back up it when there's headroom again.
+typedef struct
+{
+    const char *name;
+    int interp;
+    int dsp;
+} xmp_quality_t;
+
+static const xmp_quality_t xmp_quality[] = {
+    { "spline", XMP_INTERP_SPLINE, XMP_DSP_LOWPASS },
+    { "linear", XMP_INTERP_LINEAR, XMP_DSP_LOWPASS },
+    { "nearest", XMP_INTERP_NEAREST, XMP_DSP_LOWPASS },
+    { "nearest/nofilter", XMP_INTERP_NEAREST, 0 },
+};
+
+#define XMP_QUALITY_LEVELS (sizeof(xmp_quality) / sizeof(xmp_quality[0]))
+
+void xmp_apply_quality(xmp_context ctx, int level)
+{
+    xmp_set_player(ctx, XMP_PLAYER_INTERP, xmp_quality[level].interp);
+    xmp_set_player(ctx, XMP_PLAYER_DSP, xmp_quality[level].dsp);
+}
+
 void *audiothread_xmp(void *param)
 {
     audiothread_instructions_t *instructions = (audiothread_instructions_t *)param;
 
     xmp_context ctx = xmp_create_context();
 
-    if (xmp_load_module(ctx, instructions->filename) < 0)
+    if (xmp_load_module(ctx, instructions->path) < 0)
     {
         instructions->error = 1;
         return 0;
@@ -56,40 +251,100 @@ void *audiothread_xmp(void *param)
         ATOMIC(strcpy(instructions->modulename, mi.mod->name));
         ATOMIC(strcpy(instructions->tracker, mi.mod->type));
 
-        audio_register_ringbuffer(AUDIO_FORMAT_16BIT, SAMPLERATE, BUFSIZE);
+        mixer_stream_t *stream = mixer_stream_open(SAMPLERATE, instructions->gain);
+
+        // Keep a copy of what we render so replays can skip synthesis entirely. Modules
+        // loop forever, so a single pass through the song is what gets recorded.
+        xmp_get_frame_info(ctx, &fi);
+        unsigned int pass_samples = (unsigned int)(((uint64_t)fi.total_time * SAMPLERATE) / 1000);
+        pcmcache_entry_t *recording = pcmcache_record(instructions->filename, SAMPLERATE, 2, pass_samples);
 
-        while (xmp_play_frame(ctx) == 0 && instructions->exit == 0)
+        // Start at the best quality, and let the governor trade it away if dense
+        // modules can't be rendered in real time.
+        governor_t governor;
+        governor_init(&governor, XMP_QUALITY_LEVELS - 1);
+        xmp_apply_quality(ctx, governor.level);
+
+        while (instructions->exit == 0)
         {
+            // Render straight into the mixer's queue, waiting for it to have room.
+            uint32_t *samples;
+            int numsamples = mixer_stream_acquire(stream, &samples);
+            if (numsamples < 0)
+            {
+                instructions->error = 3;
+                break;
+            }
+            if (numsamples == 0)
+            {
+                // Sleep for the time it takes to play one queued block so we can wake up and
+                // fill it again.
+                thread_sleep((int)(1000000.0 * ((float)MIXER_QUEUE_BLOCK_SAMPLES / (float)SAMPLERATE)));
+                continue;
+            }
+
+            int profile = profile_start();
+            // Modules loop forever, just like they did when we played them a frame at a time.
+            int played = xmp_play_buffer(ctx, samples, numsamples * 4, 0);
+            uint32_t elapsed = profile_end(profile);
+            if (played != 0)
+            {
+                break;
+            }
+
             xmp_get_frame_info(ctx, &fi);
-            int numsamples = fi.buffer_size / 4;
-            uint32_t *samples = (uint32_t *)fi.buffer;
 
-            ATOMIC(sprintf(instructions->position, "%3d/%3d %3d/%3d", fi.pos, mi.mod->len, fi.row, fi.num_rows));
-            while (numsamples > 0)
+            int oldlevel = governor.level;
+            if (governor_update(&governor, elapsed, (uint32_t)((1000000.0 * numsamples) / SAMPLERATE)) != 0)
             {
-                int actual_written = audio_write_stereo_data(samples, numsamples);
-                if (actual_written < 0)
+                xmp_apply_quality(ctx, governor.level);
+                eventlog_printf(
+                    "xmp: %s -> %s, block %uus/%uus, load %u%%",
+                    xmp_quality[oldlevel].name,
+                    xmp_quality[governor.level].name,
+                    governor.last_elapsed_us,
+                    governor.last_budget_us,
+                    governor.load
+                );
+
+                if (recording)
                 {
-                    instructions->error = 3;
-                    break;
+                    // We don't want to replay a degraded render forever, so don't cache this one.
+                    pcmcache_finish(recording, mi.mod->name, mi.mod->type, 0);
+                    recording = 0;
                 }
-                if (actual_written < numsamples)
-                {
-                    numsamples -= actual_written;
-                    samples += actual_written;
+            }
 
-                    // Sleep for the time it takes to play half our buffer so we can wake up and
-                    // fill it again.
-                    thread_sleep((int)(1000000.0 * (((float)BUFSIZE / 4.0) / (float)SAMPLERATE)));
-                }
-                else
+            if (recording && fi.loop_count > 0)
+            {
+                // The song just wrapped around, so we have all of it. Only keep the part of
+                // this block from before the loop, and let replays loop the same way.
+                unsigned int amount = numsamples;
+                if (pass_samples > recording->numsamples && (pass_samples - recording->numsamples) < amount)
                 {
-                    numsamples = 0;
+                    amount = pass_samples - recording->numsamples;
                 }
+
+                pcmcache_append(recording, (int16_t *)samples, amount);
+                recording->loops = 1;
+                pcmcache_finish(recording, mi.mod->name, mi.mod->type, 1);
+                recording = 0;
+            }
+            else
+            {
+                pcmcache_append(recording, (int16_t *)samples, numsamples);
             }
+
+            ATOMIC(sprintf(instructions->position, "%3d/%3d %3d/%3d", fi.pos, mi.mod->len, fi.row, fi.num_rows));
+            first_sample(instructions);
+            mixer_stream_commit(stream, numsamples);
         }
 
-        audio_unregister_ringbuffer();
+        // Let whatever is still queued play out unless we were asked to stop.
+        mixer_stream_close(stream, instructions->exit == 0);
+
+        // A recording still going was stopped before the song looped, so it's incomplete.
+        pcmcache_finish(recording, mi.mod->name, mi.mod->type, 0);
 
         xmp_end_player(ctx);
         xmp_release_module(ctx);
@@ -99,6 +354,130 @@ void *audiothread_xmp(void *param)
     return 0;
 }
 
+// Most voices we let a MIDI song use at once, and the lower limits the governor
+// falls back to when rendering can't keep up.
+#define TIMIDITY_MAX_POLYPHONY 32
+
+static const unsigned int timidity_polyphony[] = { TIMIDITY_MAX_POLYPHONY, 24, 16, 12, 8 };
+
+#define TIMIDITY_POLYPHONY_LEVELS (sizeof(timidity_polyphony) / sizeof(timidity_polyphony[0]))
+
+typedef struct
+{
+    unsigned int polyphony;
+    unsigned int active_voices;
+    unsigned int peak_voices;
+    unsigned int peak_demand;
+    unsigned int steals;
+    unsigned int render_us;
+    unsigned int budget_us;
+} timidity_stats_t;
+
+timidity_stats_t timidity_stats;
+
+MidSong *timidity_load(uint8_t *midi, unsigned int size, unsigned int polyphony, MidSongOptions *options, midifilter_result_t *filtered)
+{
+    MidIStream *stream;
+    if (midifilter_apply(midi, size, polyphony, filtered) == 0)
+    {
+        stream = mid_istream_open_mem(filtered->data, filtered->size);
+    }
+    else
+    {
+        // We couldn't make sense of it, so let timidity have a go at the original.
+        stream = mid_istream_open_mem(midi, size);
+    }
+
+    if (stream == NULL)
+    {
+        return NULL;
+    }
+
+    MidSong *song = mid_song_load (stream, options);
+    mid_istream_close (stream);
+
+    // Timidity has its own copy of the events now, we only need the voice timeline.
+    free(filtered->data);
+    filtered->data = 0;
+    return song;
+}
+
+typedef struct
+{
+    uint8_t *midi;
+    unsigned int midisize;
+    int level;
+    MidSongOptions *options;
+    midifilter_result_t filtered;
+    MidSong *song;
+    uint32_t thread;
+    volatile int done;
+} timidity_reload_t;
+
+void *timidity_reload_thread(void *param)
+{
+    timidity_reload_t *reload = (timidity_reload_t *)param;
+
+    // Reading every patch back out of ROM and refiltering the song takes far longer
+    // than we have queued up, so it happens here instead of on the decoder thread.
+    reload->song = timidity_load(reload->midi, reload->midisize, timidity_polyphony[reload->level], reload->options, &reload->filtered);
+    if (reload->song)
+    {
+        mid_song_set_volume(reload->song, 100);
+        mid_song_start(reload->song);
+    }
+
+    reload->done = 1;
+    return 0;
+}
+
+void timidity_reload_start(timidity_reload_t *reload, int level)
+{
+    // Same priority as metadata lookups, so it only runs while the decoder is waiting
+    // on the mixer and never holds up rendering.
+    reload->level = level;
+    reload->song = 0;
+    reload->done = 0;
+    reload->thread = thread_create("midi reload", &timidity_reload_thread, reload);
+    thread_priority(reload->thread, 0);
+    thread_start(reload->thread);
+}
+
+int timidity_reload_fits(unsigned int songbytes)
+{
+    // Timidity keeps its own copy of every patch a song uses, so until the swap both
+    // songs and their patches are in memory at once. Only build the new one if the
+    // heap has room for a second copy, rather than risk running out mid-song.
+    void *probe = malloc(songbytes);
+    if (probe == 0)
+    {
+        return 0;
+    }
+
+    free(probe);
+    return 1;
+}
+
+void timidity_reload_finish(timidity_reload_t *reload)
+{
+    thread_join(reload->thread);
+    thread_destroy(reload->thread);
+    reload->thread = 0;
+}
+
+void timidity_publish_stats(midifilter_result_t *filtered, unsigned int polyphony, uint32_t current_time, governor_t *governor)
+{
+    ATOMIC({
+        timidity_stats.polyphony = polyphony;
+        timidity_stats.active_voices = midifilter_voices_at(filtered, current_time);
+        timidity_stats.peak_voices = filtered->peak_voices;
+        timidity_stats.peak_demand = filtered->peak_demand;
+        timidity_stats.steals = filtered->steals;
+        timidity_stats.render_us = governor->last_elapsed_us;
+        timidity_stats.budget_us = governor->last_budget_us;
+    });
+}
+
 void *audiothread_timidity(void *param)
 {
     audiothread_instructions_t *instructions = (audiothread_instructions_t *)param;
@@ -109,8 +488,10 @@ void *audiothread_timidity(void *param)
         return 0;
     }
 
-    MidIStream *stream = mid_istream_open_file (instructions->filename);
-    if (stream == NULL)
+    // We rewrite the song to cap its polyphony, so we need it all in memory.
+    unsigned int midisize;
+    uint8_t *midi = read_file(instructions->path, &midisize);
+    if (midi == NULL)
     {
         mid_exit();
         instructions->error = 2;
@@ -123,8 +504,18 @@ void *audiothread_timidity(void *param)
         options.channels = 2;
         options.buffer_size = BUFSIZE / 4;
 
-        MidSong *song = mid_song_load (stream, &options);
-        mid_istream_close (stream);
+        // Start with the full polyphony, and let the governor lower it if busy songs
+        // take longer to render than they take to play.
+        governor_t governor;
+        governor_init(&governor, TIMIDITY_POLYPHONY_LEVELS - 1);
+
+        // Remember how much memory the song and its patches took, which is what it
+        // will take again to load it with a different voice limit.
+        midifilter_result_t filtered;
+        struct mallinfo before = mallinfo();
+        MidSong *song = timidity_load(midi, midisize, timidity_polyphony[governor.level], &options, &filtered);
+        struct mallinfo after = mallinfo();
+        unsigned int songbytes = after.uordblks > before.uordblks ? after.uordblks - before.uordblks : 0;
 
         if (song == NULL)
         {
@@ -132,57 +523,150 @@ void *audiothread_timidity(void *param)
         }
         else
         {
-            uint32_t *buffer = malloc(BUFSIZE);
+            // We already walked every event to cap polyphony, so the title and length came
+            // for free. Only ask timidity if we couldn't parse the song ourselves.
+            uint32_t length_ms = filtered.length_ms > 0 ? filtered.length_ms : mid_song_get_total_time(song);
+            instructions->duration = length_ms / 1000;
 
-            uint32_t total_time = mid_song_get_total_time(song);
-            char *title = mid_song_get_meta (song, MID_SONG_TEXT);
-
-            ATOMIC(strcpy(instructions->modulename, title == NULL ? "no song title" : title));
+            ATOMIC(strcpy(instructions->modulename, filtered.title[0] == 0 ? "no song title" : filtered.title));
             ATOMIC(strcpy(instructions->tracker, "midi"));
 
             mid_song_set_volume(song, 100);
             mid_song_start(song);
 
-            audio_register_ringbuffer(AUDIO_FORMAT_16BIT, SAMPLERATE, BUFSIZE);
+            mixer_stream_t *stream = mixer_stream_open(SAMPLERATE, instructions->gain);
+
+            // Keep a copy of what we render so replays can skip synthesis entirely.
+            pcmcache_entry_t *recording = pcmcache_record(instructions->filename, SAMPLERATE, 2, (unsigned int)(((uint64_t)length_ms * SAMPLERATE) / 1000));
 
-            int bytes_read;
-            while (instructions->exit == 0 && (bytes_read = mid_song_read_wave(song, (void *)buffer, BUFSIZE)))
+            // Level the playing song was loaded at, which trails the governor while a
+            // song with the new voice limit is being built in the background.
+            int loaded_level = governor.level;
+            int skipped_level = -1;
+            timidity_reload_t reload;
+            memset(&reload, 0, sizeof(reload));
+            reload.midi = midi;
+            reload.midisize = midisize;
+            reload.options = &options;
+
+            while (instructions->exit == 0)
             {
-                int numsamples = bytes_read / 4;
-                uint32_t *samples = buffer;
+                // Render straight into the mixer's queue, waiting for it to have room.
+                uint32_t *samples;
+                int numsamples = mixer_stream_acquire(stream, &samples);
+                if (numsamples < 0)
+                {
+                    instructions->error = 3;
+                    break;
+                }
+                if (numsamples == 0)
+                {
+                    // Sleep for the time it takes to play one queued block so we can wake up and
+                    // fill it again.
+                    thread_sleep((int)(1000000.0 * ((float)MIXER_QUEUE_BLOCK_SAMPLES / (float)SAMPLERATE)));
+                    continue;
+                }
+
+                int profile = profile_start();
+                int bytes_read = mid_song_read_wave(song, (void *)samples, numsamples * 4);
+                uint32_t elapsed = profile_end(profile);
+                if (bytes_read == 0)
+                {
+                    break;
+                }
 
+                numsamples = bytes_read / 4;
                 uint32_t current_time = mid_song_get_time(song);
-                ATOMIC(sprintf(instructions->position, "%lu/%lu", current_time / 1000, total_time / 1000));
-                while (numsamples > 0)
+
+                int oldlevel = governor.level;
+                if (governor_update(&governor, elapsed, (uint32_t)((1000000.0 * numsamples) / SAMPLERATE)) != 0)
+                {
+                    eventlog_printf(
+                        "midi: %u -> %u voices, block %uus/%uus, load %u%%",
+                        timidity_polyphony[oldlevel],
+                        timidity_polyphony[governor.level],
+                        governor.last_elapsed_us,
+                        governor.last_budget_us,
+                        governor.load
+                    );
+                    skipped_level = -1;
+
+                    if (recording)
+                    {
+                        // We don't want to replay a degraded render forever, so don't cache this one.
+                        pcmcache_finish(recording, instructions->modulename, "midi", 0);
+                        recording = 0;
+                    }
+                }
+
+                if (reload.thread && reload.done)
                 {
-                    int actual_written = audio_write_stereo_data(samples, numsamples);
-                    if (actual_written < 0)
+                    // Timidity has no way to change polyphony on a loaded song, so swap in the
+                    // one built with the new limit and pick up where we left off. Seeking only
+                    // replays events, so it's cheap next to loading.
+                    timidity_reload_finish(&reload);
+                    if (reload.song)
                     {
-                        instructions->error = 3;
-                        break;
+                        mid_song_seek(reload.song, current_time);
+                        mid_song_free(song);
+                        midifilter_free(&filtered);
+
+                        song = reload.song;
+                        filtered = reload.filtered;
+                        loaded_level = reload.level;
                     }
-                    if (actual_written < numsamples)
+                    else
                     {
-                        numsamples -= actual_written;
-                        samples += actual_written;
+                        midifilter_free(&reload.filtered);
+                        eventlog_printf("midi: couldn't reload at %u voices", timidity_polyphony[reload.level]);
+                    }
+                }
 
-                        // Sleep for the time it takes to play half our buffer so we can wake up and
-                        // fill it again.
-                        thread_sleep((int)(1000000.0 * (((float)BUFSIZE / 4.0) / (float)SAMPLERATE)));
+                if (reload.thread == 0 && governor.level != loaded_level && governor.level != skipped_level)
+                {
+                    // The governor may have moved again while we were reloading, in which
+                    // case this catches the song up to wherever it ended up.
+                    if (timidity_reload_fits(songbytes))
+                    {
+                        timidity_reload_start(&reload, governor.level);
                     }
                     else
                     {
-                        numsamples = 0;
+                        eventlog_printf("midi: no room to reload at %u voices", timidity_polyphony[governor.level]);
+                        skipped_level = governor.level;
                     }
                 }
+
+                timidity_publish_stats(&filtered, timidity_polyphony[loaded_level], current_time, &governor);
+                pcmcache_append(recording, (int16_t *)samples, numsamples);
+
+                publish_position(instructions, current_time / 1000);
+                first_sample(instructions);
+                mixer_stream_commit(stream, numsamples);
             }
 
-            audio_unregister_ringbuffer();
+            // Let whatever is still queued play out unless we were asked to stop.
+            mixer_stream_close(stream, instructions->exit == 0);
 
-            mid_song_free (song);
+            // Only a track that played all the way through is worth replaying from cache.
+            pcmcache_finish(recording, instructions->modulename, "midi", instructions->exit == 0 && instructions->error == 0);
+
+            if (reload.thread)
+            {
+                // Nobody is going to play the song that was being built.
+                timidity_reload_finish(&reload);
+                if (reload.song)
+                {
+                    mid_song_free(reload.song);
+                }
+                midifilter_free(&reload.filtered);
+            }
 
-            free(buffer);
+            mid_song_free (song);
         }
+
+        midifilter_free(&filtered);
+        arena_free(midi);
     }
 
     mid_exit();
@@ -197,6 +681,70 @@ void mpg123_ptr_to_string(void *ptr, char *string, int size)
     string[copysize] = 0;
 }
 
+void *metadata_mpg123(void *param)
+{
+    audiothread_instructions_t *instructions = (audiothread_instructions_t *)param;
+
+    // Use our own handle so scanning doesn't disturb the decoder's read position.
+    int err = 0;
+    mpg123_handle *mh = mpg123_new(NULL, &err);
+    if (err != 0 || mpg123_open(mh, instructions->filename) != MPG123_OK)
+    {
+        if (err == 0)
+        {
+            mpg123_delete(mh);
+        }
+        ATOMIC(strcpy(instructions->modulename, "no song title"));
+        return 0;
+    }
+
+    // Attempt to read ID3 tag to display title.
+    mpg123_id3v1 *v1;
+    mpg123_id3v2 *v2;
+
+    mpg123_scan(mh);
+    int meta = mpg123_meta_check(mh);
+    if(meta & MPG123_ID3 && mpg123_id3(mh, &v1, &v2) == MPG123_OK)
+    {
+        // Because often ID3v2 will be in unicode, favor v1 since we don't have unicode support
+        // for this simple console program.
+        if (v1 != 0)
+        {
+            ATOMIC(sprintf(instructions->modulename, "%s - %s", v1->artist, v1->title));
+        }
+        else if (v2 != 0)
+        {
+            char artist[128];
+            char title[128];
+            mpg123_ptr_to_string(v2->artist, artist, sizeof(artist));
+            mpg123_ptr_to_string(v2->title, title, sizeof(title));
+            ATOMIC(sprintf(instructions->modulename, "%s - %s", artist, title));
+        }
+        else
+        {
+            ATOMIC(strcpy(instructions->modulename, "no song title"));
+        }
+    }
+    else
+    {
+        ATOMIC(strcpy(instructions->modulename, "no song title"));
+    }
+
+    // Now that it has been scanned, the length of the file in frames is exact.
+    long samplerate;
+    int channels;
+    int encoding;
+    off_t total_samples = mpg123_length(mh);
+    if (total_samples > 0 && mpg123_getformat(mh, &samplerate, &channels, &encoding) == MPG123_OK && samplerate > 0)
+    {
+        instructions->duration = total_samples / samplerate;
+    }
+
+    mpg123_close(mh);
+    mpg123_delete(mh);
+    return 0;
+}
+
 void *audiothread_mpg123(void *param)
 {
     audiothread_instructions_t *instructions = (audiothread_instructions_t *)param;
@@ -214,6 +762,16 @@ void *audiothread_mpg123(void *param)
         return 0;
     }
 
+    // The mixer only takes 16-bit audio, so have mpg123 convert anything else for us.
+    const long *rates;
+    size_t ratecount;
+    mpg123_rates(&rates, &ratecount);
+    mpg123_format_none(mh);
+    for (size_t i = 0; i < ratecount; i++)
+    {
+        mpg123_format(mh, rates[i], MPG123_MONO | MPG123_STEREO, MPG123_ENC_SIGNED_16);
+    }
+
     // Now, open and get the info from the file.
     err = mpg123_open(mh, instructions->filename);
     if (err != MPG123_OK)
@@ -240,7 +798,7 @@ void *audiothread_mpg123(void *param)
 
     // Get the bitrate from the byterate
     int encbits = mpg123_encsize(encoding) * 8;
-    if (samplerate < 6000 || samplerate > 48000 || (channels != 1 && channels != 2) || (encbits != 8 && encbits != 16))
+    if (samplerate < 6000 || samplerate > 48000 || (channels != 1 && channels != 2) || encbits != 16)
     {
         mpg123_close(mh);
         mpg123_delete(mh);
@@ -249,122 +807,71 @@ void *audiothread_mpg123(void *param)
         return 0;
     }
 
-    // Attempt to read ID3 tag to display title.
-    mpg123_id3v1 *v1;
-    mpg123_id3v2 *v2;
-
-    mpg123_scan(mh);
-    int meta = mpg123_meta_check(mh);
-    if(meta & MPG123_ID3 && mpg123_id3(mh, &v1, &v2) == MPG123_OK)
-    {
-        // Because often ID3v2 will be in unicode, favor v1 since we don't have unicode support
-        // for this simple console program.
-        if (v1 != 0)
-        {
-            ATOMIC(sprintf(instructions->modulename, "%s - %s", v1->artist, v1->title));
-        }
-        else if (v2 != 0)
-        {
-            char artist[128];
-            char title[128];
-            mpg123_ptr_to_string(v2->artist, artist, sizeof(artist));
-            mpg123_ptr_to_string(v2->title, title, sizeof(title));
-            ATOMIC(sprintf(instructions->modulename, "%s - %s", artist, title));
-        }
-        else
-        {
-            ATOMIC(strcpy(instructions->modulename, "no song title"));
-        }
-    }
-    else
-    {
-        ATOMIC(strcpy(instructions->modulename, "no song title"));
-    }
-
-    // Attempt to grab the length of the file in frames.
-    off_t total_samples = mpg123_length(mh);
+    // Title and length need the whole file scanned, so work them out in the background.
+    metadata_start(instructions, &metadata_mpg123);
 
     // No tracker information, we're just a file decoder.
     ATOMIC(strcpy(instructions->tracker, "mp3"));
 
-    // Finally, based on the file's info, set up the encoding and samplerate.
-    audio_register_ringbuffer(encbits == 16 ? AUDIO_FORMAT_16BIT : AUDIO_FORMAT_8BIT, samplerate, BUFSIZE);
+    // Finally, based on the file's info, set up a stream at the right samplerate.
+    mixer_stream_t *stream = mixer_stream_open(samplerate, instructions->gain);
 
     // Calculate our bytes read->number of samples divisor.
-    int divisor = encbits == 16 ?
-        (channels == 2 ? 4 : 2) :
-        (channels == 2 ? 2 : 1);
+    int divisor = channels == 2 ? 4 : 2;
     size_t bytes_read;
     size_t samples_read = 0;
-    uint32_t *buffer = malloc(BUFSIZE);
 
-    while (instructions->exit == 0 && (mpg123_read(mh, buffer, BUFSIZE, &bytes_read) == MPG123_OK))
+    // The length here is only mpg123's estimate, since we leave scanning the whole
+    // file to the metadata thread.
+    off_t length = mpg123_length(mh);
+    pcmcache_entry_t *recording = pcmcache_record(instructions->filename, samplerate, channels, length > 0 ? (unsigned int)length : 0);
+
+    while (instructions->exit == 0)
     {
-        int numsamples = bytes_read / divisor;
+        // Decode straight into the mixer's queue, waiting for it to have room.
+        uint32_t *samples;
+        int numsamples = mixer_stream_acquire(stream, &samples);
+        if (numsamples < 0)
+        {
+            instructions->error = 5;
+            break;
+        }
+        if (numsamples == 0)
+        {
+            // Sleep for the time it takes to play one queued block so we can wake up and
+            // fill it again.
+            thread_sleep((int)(1000000.0 * ((float)MIXER_QUEUE_BLOCK_SAMPLES / (float)samplerate)));
+            continue;
+        }
+
+        if ((err = mpg123_read(mh, samples, numsamples * divisor, &bytes_read)) != MPG123_OK)
+        {
+            break;
+        }
+        numsamples = bytes_read / divisor;
 
         // Display the length and current offset.
-        ATOMIC(sprintf(instructions->position, "%lu/%ld", samples_read / samplerate, total_samples / samplerate));
+        publish_position(instructions, samples_read / samplerate);
         samples_read += numsamples;
+        first_sample(instructions);
 
+        pcmcache_append(recording, (int16_t *)samples, numsamples);
         if (channels == 2)
         {
-            uint32_t *samples = buffer;
-            while (numsamples > 0)
-            {
-                int actual_written = audio_write_stereo_data(samples, numsamples);
-                if (actual_written < 0)
-                {
-                    instructions->error = 5;
-                    break;
-                }
-                if (actual_written < numsamples)
-                {
-                    numsamples -= actual_written;
-                    samples += actual_written;
-
-                    // Sleep for the time it takes to play half our buffer so we can wake up and
-                    // fill it again.
-                    thread_sleep((int)(1000000.0 * (((float)BUFSIZE / 4.0) / (float)samplerate)));
-                }
-                else
-                {
-                    numsamples = 0;
-                }
-            }
+            mixer_stream_commit(stream, numsamples);
         }
         else
         {
-            uint16_t *samples = (uint16_t *)buffer;
-            while (numsamples > 0)
-            {
-                int actual_written_left = audio_write_mono_data(AUDIO_CHANNEL_LEFT, samples, numsamples);
-                int actual_written_right = audio_write_mono_data(AUDIO_CHANNEL_RIGHT, samples, numsamples);
-
-                if (actual_written_left != actual_written_right || actual_written_left < 0 || actual_written_right < 0)
-                {
-                    instructions->error = 5;
-                    break;
-                }
-                if (actual_written_left < numsamples)
-                {
-                    numsamples -= actual_written_left;
-                    samples += actual_written_left;
-
-                    // Sleep for the time it takes to play half our buffer so we can wake up and
-                    // fill it again.
-                    thread_sleep((int)(1000000.0 * (((float)BUFSIZE / 4.0) / (float)samplerate)));
-                }
-                else
-                {
-                    numsamples = 0;
-                }
-            }
+            mixer_stream_commit_mono(stream, numsamples);
         }
     }
 
-    // Done streaming, don't need the audio streaming interface anymore.
-    audio_unregister_ringbuffer();
-    free(buffer);
+    // Done streaming, let whatever is still queued play out unless we were asked to stop.
+    mixer_stream_close(stream, instructions->exit == 0);
+    metadata_finish(instructions);
+
+    // Only a track that played all the way through is worth replaying from cache.
+    pcmcache_finish(recording, instructions->modulename, "mp3", instructions->exit == 0 && instructions->error == 0 && err == MPG123_DONE);
 
     // Also don't need mpg123 anymore.
     mpg123_close(mh);
@@ -415,15 +922,78 @@ void ov_extract_comment(char *out, int size, char *field, vorbis_comment *metada
     }
 }
 
+void *metadata_vorbis(void *param)
+{
+    audiothread_instructions_t *instructions = (audiothread_instructions_t *)param;
+
+    // A seekable open walks the whole file to find every link's length, which is
+    // exactly the slow part we want off the decoder thread.
+    FILE *fp = fopen(instructions->filename, "rb");
+    OggVorbis_File vf;
+    if (fp == 0 || ov_open(fp, &vf, 0, 0) < 0)
+    {
+        if (fp != 0)
+        {
+            fclose(fp);
+        }
+        ATOMIC(strcpy(instructions->modulename, "no song title"));
+        return 0;
+    }
+
+    // Grab artist and title from metadata
+    vorbis_comment *metadata = ov_comment(&vf, -1);
+    if (metadata)
+    {
+        char artist[128];
+        char title[128];
+        ov_extract_comment(artist, sizeof(artist), "artist", metadata);
+        ov_extract_comment(title, sizeof(title), "title", metadata);
+        ATOMIC(sprintf(instructions->modulename, "%s - %s", artist, title));
+    }
+    else
+    {
+        ATOMIC(strcpy(instructions->modulename, "no song title"));
+    }
+
+    double total = ov_time_total(&vf, -1);
+    if (total >= 0)
+    {
+        instructions->duration = (int)total;
+    }
+
+    // This also closes the file for us.
+    ov_clear(&vf);
+    return 0;
+}
+
+size_t ov_stream_read(void *ptr, size_t size, size_t nmemb, void *datasource)
+{
+    return fread(ptr, size, nmemb, (FILE *)datasource);
+}
+
 void *audiothread_vorbis(void *param)
 {
     audiothread_instructions_t *instructions = (audiothread_instructions_t *)param;
 
-    // Attempt to load the ogg file.
-    FILE *fp = fopen(instructions->filename, "r");
+    // Attempt to load the ogg file. We hand vorbisfile no way to seek, so it treats
+    // the file as a stream and starts decoding without first measuring its length.
+    FILE *fp = fopen(instructions->filename, "rb");
+    if (fp == 0)
+    {
+        instructions->error = 1;
+        return 0;
+    }
+
+    // That also means no exact length, so remember the size to estimate it from.
+    fseek(fp, 0, SEEK_END);
+    long filesize = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
     OggVorbis_File vf;
-    if (ov_open(fp, &vf, 0, 0) < 0)
+    ov_callbacks callbacks = { &ov_stream_read, 0, 0, 0 };
+    if (ov_open_callbacks(fp, &vf, 0, 0, callbacks) < 0)
     {
+        fclose(fp);
         instructions->error = 1;
         return 0;
     }
@@ -446,101 +1016,437 @@ void *audiothread_vorbis(void *param)
         return 0;
     }
 
-    // Grab artist and title from metadata
-    vorbis_comment *metadata = ov_comment(&vf, -1);
-    if (metadata)
+    // Title and length come from a second, seekable look at the file in the background.
+    metadata_start(instructions, &metadata_vorbis);
+
+    // Always the same thing here.
+    ATOMIC(strcpy(instructions->tracker, "ogg"));
+
+    // Finally, based on the file's info, set up a stream at the right samplerate.
+    mixer_stream_t *stream = mixer_stream_open(info->rate, instructions->gain);
+
+    // Now, start streaming the decoded data.
+    int bytes_read = 0;
+    int bitstream;
+
+    unsigned int estimate = 0;
+    if (info->bitrate_nominal > 0 && filesize > 0)
     {
-        char artist[128];
-        char title[128];
-        ov_extract_comment(artist, sizeof(artist), "artist", metadata);
-        ov_extract_comment(title, sizeof(title), "title", metadata);
-        ATOMIC(sprintf(instructions->modulename, "%s - %s", artist, title));
+        estimate = (unsigned int)(((uint64_t)filesize * 8 * info->rate) / info->bitrate_nominal);
+    }
+    pcmcache_entry_t *recording = pcmcache_record(instructions->filename, info->rate, info->channels, estimate);
+
+    while (instructions->exit == 0)
+    {
+        // Decode straight into the mixer's queue, waiting for it to have room.
+        uint32_t *samples;
+        int numsamples = mixer_stream_acquire(stream, &samples);
+        if (numsamples < 0)
+        {
+            instructions->error = 5;
+            break;
+        }
+        if (numsamples == 0)
+        {
+            // Sleep for the time it takes to play one queued block so we can wake up and
+            // fill it again.
+            thread_sleep((int)(1000000.0 * ((float)MIXER_QUEUE_BLOCK_SAMPLES / (float)info->rate)));
+            continue;
+        }
+
+        if ((bytes_read = ov_read(&vf, (char *)samples, numsamples * 2 * info->channels, 0, 2, 1, &bitstream)) <= 0)
+        {
+            break;
+        }
+        numsamples = bytes_read / (2 * info->channels);
+
+        // Display the length and current offset.
+        publish_position(instructions, (unsigned int)ov_time_tell(&vf));
+        first_sample(instructions);
+
+        pcmcache_append(recording, (int16_t *)samples, numsamples);
+        if (info->channels == 2)
+        {
+            mixer_stream_commit(stream, numsamples);
+        }
+        else
+        {
+            mixer_stream_commit_mono(stream, numsamples);
+        }
+    }
+
+    // Done streaming, let whatever is still queued play out unless we were asked to stop.
+    mixer_stream_close(stream, instructions->exit == 0);
+    metadata_finish(instructions);
+
+    // Only a track that played all the way through is worth replaying from cache.
+    pcmcache_finish(recording, instructions->modulename, "ogg", instructions->exit == 0 && instructions->error == 0 && bytes_read == 0);
+
+    // Also don't need ogg anymore. We gave vorbisfile no close callback, so the file is ours to close.
+    ov_clear(&vf);
+    fclose(fp);
+    return 0;
+}
+
+typedef struct
+{
+    FILE *fp;
+    adpcm_header_t header;
+    uint8_t *chunk;
+    unsigned int position;
+    unsigned int end;
+    int loops;
+    int seek;
+} adpcm_track_t;
+
+// Read the rest of the chunk the track is at, going back to the loop start first if
+// we got to the end. Returns how many samples per channel are waiting in the chunk
+// starting at *offset, 0 at the end of the track or negative on error.
+int adpcm_track_read(adpcm_track_t *track, unsigned int *offset)
+{
+    unsigned int chunkbytes = adpcm_chunk_bytes(&track->header);
+
+    if (track->position >= track->end)
+    {
+        if (!track->loops)
+        {
+            return 0;
+        }
+
+        // Every channel arrives back at the loop start in exactly the decoder state it
+        // left it in, so there's nothing to do but carry on from there.
+        track->position = track->header.loop_start;
+        track->seek = 1;
+    }
+
+    unsigned int chunk = track->position / track->header.chunk_samples;
+    if (track->seek)
+    {
+        fseek(track->fp, sizeof(adpcm_header_t) + (chunk * chunkbytes), SEEK_SET);
+        track->seek = 0;
+    }
+    if (fread(track->chunk, chunkbytes, 1, track->fp) != 1)
+    {
+        return -1;
+    }
+
+    *offset = track->position % track->header.chunk_samples;
+    unsigned int available = track->header.chunk_samples - *offset;
+    if (available > track->end - track->position) { available = track->end - track->position; }
+    track->position += available;
+    return available;
+}
+
+// Where in the track we are after playing this many samples, going around its loop.
+unsigned int adpcm_track_seconds(adpcm_track_t *track, unsigned int played)
+{
+    if (track->loops && played >= track->end)
+    {
+        unsigned int length = track->end - track->header.loop_start;
+        played = track->header.loop_start + ((played - track->header.loop_start) % length);
+    }
+
+    return played / track->header.samplerate;
+}
+
+void adpcm_play_hardware(audiothread_instructions_t *instructions, adpcm_track_t *track, aicastream_t *stream)
+{
+    // Nibbles that keep the decoder where it is, for playing out the end of the ring.
+    static const uint8_t hold[256] = { [0 ... 255] = 0x80 };
+    unsigned int channelbytes = adpcm_channel_bytes(&track->header);
+    unsigned int ahead = 0;
+    int started = 0;
+
+    while (instructions->exit == 0)
+    {
+        unsigned int offset = 0;
+        int available = adpcm_track_read(track, &offset);
+        if (available < 0)
+        {
+            instructions->error = 3;
+            break;
+        }
+
+        const uint8_t *data[2];
+        for (unsigned int channel = 0; channel < track->header.channels; channel++)
+        {
+            data[channel] = available > 0 ? track->chunk + (channel * channelbytes) + (offset / 2) : hold;
+        }
+
+        // Once the track is over, feed silence until the hardware has played it all.
+        int finished = available == 0;
+        if (finished)
+        {
+            if (aicastream_position(stream) >= ahead)
+            {
+                break;
+            }
+            available = sizeof(hold) * 2;
+        }
+        else
+        {
+            ahead += available;
+        }
+
+        while (available > 0 && instructions->exit == 0)
+        {
+            int space = aicastream_space(stream);
+            if (space < 0)
+            {
+                // The hardware got ahead of us and played garbage, which loses its place.
+                instructions->error = 4;
+                return;
+            }
+            if (space == 0)
+            {
+                // The ring is full, so now's the time to start it if we haven't yet.
+                if (!started)
+                {
+                    aicastream_start(stream);
+                    first_sample(instructions);
+                    started = 1;
+                }
+
+                // Sleep for the time it takes to play one queued block so we can wake up and
+                // fill it again.
+                thread_sleep((int)(1000000.0 * ((float)MIXER_QUEUE_BLOCK_SAMPLES / (float)track->header.samplerate)));
+                publish_position(instructions, adpcm_track_seconds(track, aicastream_position(stream)));
+                continue;
+            }
+
+            unsigned int amount = (unsigned int)space < (unsigned int)available ? (unsigned int)space : (unsigned int)available;
+            aicastream_write(stream, data, amount);
+            for (unsigned int channel = 0; channel < track->header.channels; channel++)
+            {
+                data[channel] += amount / 2;
+            }
+            available -= amount;
+        }
+
+        // Short tracks might never fill the ring.
+        if (finished && !started)
+        {
+            aicastream_start(stream);
+            first_sample(instructions);
+            started = 1;
+        }
+    }
+}
+
+void adpcm_play_software(audiothread_instructions_t *instructions, adpcm_track_t *track)
+{
+    mixer_stream_t *stream = mixer_stream_open(track->header.samplerate, instructions->gain);
+    unsigned int channelbytes = adpcm_channel_bytes(&track->header);
+    uint32_t *buffer = arena_alloc(track->header.chunk_samples * sizeof(uint32_t));
+
+    adpcm_state_t state[2];
+    adpcm_reset(&state[0]);
+    adpcm_reset(&state[1]);
+
+    while (instructions->exit == 0)
+    {
+        unsigned int offset = 0;
+        int available = adpcm_track_read(track, &offset);
+        if (available <= 0)
+        {
+            instructions->error = available < 0 ? 3 : 0;
+            break;
+        }
+
+        for (unsigned int channel = 0; channel < track->header.channels; channel++)
+        {
+            adpcm_decode(&state[channel], (int16_t *)buffer + channel, track->header.channels, track->chunk + (channel * channelbytes), offset, available);
+        }
+
+        // Display the length and current offset.
+        publish_position(instructions, adpcm_track_seconds(track, track->position - available));
+        first_sample(instructions);
+
+        unsigned int numsamples = available;
+        if (track->header.channels == 2)
+        {
+            uint32_t *samples = buffer;
+            while (numsamples > 0)
+            {
+                int actual_written = mixer_stream_write_stereo(stream, samples, numsamples);
+                if (actual_written < 0)
+                {
+                    instructions->error = 4;
+                    break;
+                }
+                if (actual_written < numsamples)
+                {
+                    numsamples -= actual_written;
+                    samples += actual_written;
+
+                    // Sleep for the time it takes to play one queued block so we can wake up and
+                    // fill it again.
+                    thread_sleep((int)(1000000.0 * ((float)MIXER_QUEUE_BLOCK_SAMPLES / (float)track->header.samplerate)));
+                }
+                else
+                {
+                    numsamples = 0;
+                }
+            }
+        }
+        else
+        {
+            int16_t *samples = (int16_t *)buffer;
+            while (numsamples > 0)
+            {
+                int actual_written = mixer_stream_write_mono(stream, samples, numsamples);
+                if (actual_written < 0)
+                {
+                    instructions->error = 4;
+                    break;
+                }
+                if (actual_written < numsamples)
+                {
+                    numsamples -= actual_written;
+                    samples += actual_written;
+
+                    // Sleep for the time it takes to play one queued block so we can wake up and
+                    // fill it again.
+                    thread_sleep((int)(1000000.0 * ((float)MIXER_QUEUE_BLOCK_SAMPLES / (float)track->header.samplerate)));
+                }
+                else
+                {
+                    numsamples = 0;
+                }
+            }
+        }
+
+        if (instructions->error)
+        {
+            break;
+        }
+    }
+
+    // Let whatever is still queued play out unless we were asked to stop.
+    mixer_stream_close(stream, instructions->exit == 0);
+    arena_free(buffer);
+}
+
+void *audiothread_adpcm(void *param)
+{
+    audiothread_instructions_t *instructions = (audiothread_instructions_t *)param;
+
+    adpcm_track_t track;
+    memset(&track, 0, sizeof(track));
+    track.fp = fopen(instructions->filename, "rb");
+    if (track.fp == 0)
+    {
+        instructions->error = 1;
+        return 0;
+    }
+
+    if (fread(&track.header, sizeof(track.header), 1, track.fp) != 1 || adpcm_check_header(&track.header) != 0)
+    {
+        fclose(track.fp);
+        instructions->error = 2;
+        return 0;
+    }
+
+    // Looping tracks go back to the loop start when they get to the loop end, forever.
+    track.loops = track.header.loop_start != ADPCM_NO_LOOP;
+    track.end = track.loops ? track.header.loop_end : track.header.numsamples;
+    track.chunk = arena_alloc(adpcm_chunk_bytes(&track.header));
+
+    // Hand it to the sound hardware to decode if we can, otherwise it's cheap enough to
+    // decode ourselves. Either way there's no point spending RAM caching it.
+    aicastream_t *hardware = 0;
+    if (ADPCM_HARDWARE)
+    {
+        hardware = aicastream_open(track.header.samplerate, track.header.channels, instructions->gain);
+    }
+
+    // Everything we need to know was worked out when this was rendered.
+    ATOMIC(strcpy(instructions->modulename, track.header.title));
+    ATOMIC(sprintf(instructions->tracker, "adpcm (%s, %s)", track.header.source, hardware ? "aica" : "software"));
+    instructions->duration = track.header.numsamples / track.header.samplerate;
+
+    if (hardware)
+    {
+        adpcm_play_hardware(instructions, &track, hardware);
+        aicastream_close(hardware);
     }
     else
     {
-        ATOMIC(strcpy(instructions->modulename, "no song title"));
+        adpcm_play_software(instructions, &track);
     }
 
-    // Always the same thing here.
-    ATOMIC(strcpy(instructions->tracker, "ogg"));
+    arena_free(track.chunk);
+    fclose(track.fp);
+    return 0;
+}
 
-    // Finally, based on the file's info, set up the encoding and samplerate.
-    audio_register_ringbuffer(AUDIO_FORMAT_16BIT, info->rate, BUFSIZE);
+void *audiothread_pcmcache(void *param)
+{
+    audiothread_instructions_t *instructions = (audiothread_instructions_t *)param;
+    pcmcache_entry_t *entry = instructions->cached;
 
-    // Now, start streaming the decoded data.
-    int bytes_read;
-    int bitstream;
-    uint32_t *buffer = malloc(BUFSIZE);
-    while (instructions->exit == 0 && (bytes_read = ov_read(&vf, (char *)buffer, BUFSIZE, 0, 2, 1, &bitstream)) > 0)
-    {
-        int numsamples = bytes_read / (2 * info->channels);
+    // Everything we need to know was saved alongside the audio itself.
+    ATOMIC(strcpy(instructions->modulename, entry->modulename));
+    ATOMIC(strcpy(instructions->tracker, entry->tracker));
 
-        // Display the length and current offset.
-        ATOMIC(sprintf(instructions->position, "%d/%d", (int)ov_time_tell(&vf), (int)ov_time_total(&vf, -1)));
+    mixer_stream_t *stream = mixer_stream_open(entry->samplerate, instructions->gain);
 
-        if (info->channels == 2)
-        {
-            uint32_t *samples = buffer;
-            while (numsamples > 0)
-            {
-                int actual_written = audio_write_stereo_data(samples, numsamples);
-                if (actual_written < 0)
-                {
-                    instructions->error = 5;
-                    break;
-                }
-                if (actual_written < numsamples)
-                {
-                    numsamples -= actual_written;
-                    samples += actual_written;
+    pcmcache_reader_t reader;
+    pcmcache_reader_init(&reader, entry);
 
-                    // Sleep for the time it takes to play half our buffer so we can wake up and
-                    // fill it again.
-                    thread_sleep((int)(1000000.0 * (((float)BUFSIZE / 4.0) / (float)info->rate)));
-                }
-                else
-                {
-                    numsamples = 0;
-                }
-            }
+    unsigned int samples_played = 0;
+    while (instructions->exit == 0)
+    {
+        // Unpack straight into the mixer's queue, waiting for it to have room.
+        uint32_t *samples;
+        int numsamples = mixer_stream_acquire(stream, &samples);
+        if (numsamples < 0)
+        {
+            instructions->error = 1;
+            break;
         }
-        else
+        if (numsamples == 0)
         {
-            uint16_t *samples = (uint16_t *)buffer;
-            while (numsamples > 0)
+            // Sleep for the time it takes to play one queued block so we can wake up and
+            // fill it again.
+            thread_sleep((int)(1000000.0 * ((float)MIXER_QUEUE_BLOCK_SAMPLES / (float)entry->samplerate)));
+            continue;
+        }
+
+        numsamples = pcmcache_read(&reader, (int16_t *)samples, numsamples);
+        if (numsamples == 0)
+        {
+            if (!entry->loops)
             {
-                int actual_written_left = audio_write_mono_data(AUDIO_CHANNEL_LEFT, samples, numsamples);
-                int actual_written_right = audio_write_mono_data(AUDIO_CHANNEL_RIGHT, samples, numsamples);
+                break;
+            }
 
-                if (actual_written_left != actual_written_right || actual_written_left < 0 || actual_written_right < 0)
-                {
-                    instructions->error = 5;
-                    break;
-                }
-                if (actual_written_left < numsamples)
-                {
-                    numsamples -= actual_written_left;
-                    samples += actual_written_left;
+            // Tracks that looped when they were recorded keep looping on replay.
+            pcmcache_reader_init(&reader, entry);
+            samples_played = 0;
+            continue;
+        }
 
-                    // Sleep for the time it takes to play half our buffer so we can wake up and
-                    // fill it again.
-                    thread_sleep((int)(1000000.0 * (((float)BUFSIZE / 4.0) / (float)info->rate)));
-                }
-                else
-                {
-                    numsamples = 0;
-                }
-            }
+        // Display the length and current offset.
+        ATOMIC(sprintf(instructions->position, "%u/%u (cached)", samples_played / entry->samplerate, entry->numsamples / entry->samplerate));
+        samples_played += numsamples;
+        first_sample(instructions);
+
+        if (entry->channels == 2)
+        {
+            mixer_stream_commit(stream, numsamples);
+        }
+        else
+        {
+            mixer_stream_commit_mono(stream, numsamples);
         }
     }
 
-    // Done streaming, don't need the audio streaming interface anymore.
-    audio_unregister_ringbuffer();
-    free(buffer);
+    // Let whatever is still queued play out unless we were asked to stop.
+    mixer_stream_close(stream, instructions->exit == 0);
 
-    // Also don't need ogg anymore.
-    ov_clear(&vf);
-    fclose(fp);
+    // Allow this entry to be evicted again.
+    pcmcache_release(entry);
     return 0;
 }
 
@@ -556,14 +1462,43 @@ char lower(char c)
 
 audiothread_instructions_t * play(char *filename)
 {
-    audiothread_instructions_t *inst = malloc(sizeof(audiothread_instructions_t));
+    // Everything from here until stop() lives in a fresh arena.
+    arena_begin();
+    audiothread_instructions_t *inst = arena_alloc(sizeof(audiothread_instructions_t));
     memset(inst, 0, sizeof(audiothread_instructions_t));
     strcpy(inst->filename, filename);
+    lz4file_mounted_name(filename, inst->path, sizeof(inst->path));
+    strcpy(inst->modulename, "(loading)");
+    inst->duration = -1;
+
+    // Measured when the ROM was built, so playing at an even volume costs us nothing here.
+    inst->gain = loudness_lookup(filename, &inst->peak);
+
+    // Never boost a track past the point where its own peak would clip, so that the
+    // limiter is only there for what the mix and EQ add on top.
+    if (inst->peak > 0)
+    {
+        int maxgain = (32767 * MIXER_UNITY_GAIN) / (int)inst->peak;
+        if (inst->gain > maxgain) { inst->gain = maxgain; }
+    }
+
+    // Time-to-first-sample starts counting now, before we even look at the file.
+    inst->ttfs_profile = profile_start();
 
     // Figure out the extension for this file.
     char ext[32] = { 0 };
     int extlen = 0;
     int fnamelen = strlen(filename);
+    if (lz4file_is_compressed(filename))
+    {
+        // The real extension is the one before the compression suffix.
+        fnamelen -= strlen(LZ4FILE_SUFFIX);
+    }
+    else if (adpcm_is_prerendered(filename))
+    {
+        // Same for tracks we pre-rendered, we'll just remember that they were.
+        fnamelen -= strlen(ADPCM_SUFFIX);
+    }
     while (extlen < sizeof(ext) - 1)
     {
         int pos = fnamelen - (extlen + 1);
@@ -581,20 +1516,37 @@ audiothread_instructions_t * play(char *filename)
         ext[extlen] = 0;
     }
 
-    if (strcmp(ext, "dim") == 0)
+    // Anything we've fully decoded recently can be replayed straight from RAM.
+    inst->cached = pcmcache_lookup(filename);
+
+    if (inst->cached)
+    {
+        inst->format = FORMAT_CACHED;
+        inst->thread = thread_create("audio", &audiothread_pcmcache, inst);
+    }
+    else if (adpcm_is_prerendered(filename))
+    {
+        inst->format = FORMAT_ADPCM;
+        inst->thread = thread_create("audio", &audiothread_adpcm, inst);
+    }
+    else if (strcmp(ext, "dim") == 0)
     {
+        inst->format = FORMAT_MIDI;
         inst->thread = thread_create("audio", &audiothread_timidity, inst);
     }
     else if (strcmp(ext, "3pm") == 0)
     {
+        inst->format = FORMAT_MP3;
         inst->thread = thread_create("audio", &audiothread_mpg123, inst);
     }
     else if (strcmp(ext, "ggo") == 0)
     {
+        inst->format = FORMAT_OGG;
         inst->thread = thread_create("audio", &audiothread_vorbis, inst);
     }
     else
     {
+        inst->format = FORMAT_MODULE;
         inst->thread = thread_create("audio", &audiothread_xmp, inst);
     }
     thread_priority(inst->thread, 1);
@@ -607,12 +1559,34 @@ void stop(audiothread_instructions_t *inst)
     inst->exit = 1;
     thread_join(inst->thread);
     thread_destroy(inst->thread);
-    free(inst);
+    if (!inst->ttfs_done)
+    {
+        // Never got as far as making a sound, but the profile still needs to be freed.
+        profile_end(inst->ttfs_profile);
+    }
+
+    int format = inst->format;
+    arena_free(inst);
+
+    // Nothing from this session is in use anymore, so hand it all back at once.
+    unsigned int peak = arena_end();
+    if (peak > arena_peak[format])
+    {
+        arena_peak[format] = peak;
+    }
+
+    // The decoder libraries allocate from the heap, so see what they left behind.
+    struct mallinfo heap = mallinfo();
+    ATOMIC({
+        heap_stats.last = heap.uordblks;
+        if (heap_stats.last > heap_stats.peak) { heap_stats.peak = heap_stats.last; }
+    });
 }
 
 typedef struct
 {
     char filename[256];
+    char displayname[256];
     int type;
 } file_t;
 
@@ -652,6 +1626,11 @@ file_t *list_files(const char *path, int *numentries)
             // Hide timidity directory for aesthetic reasons.
             continue;
         }
+        if (is_root && direntp->d_type != DT_DIR && strcmp(direntp->d_name, "loudness.txt") == 0)
+        {
+            // Hide the build-time loudness table too.
+            continue;
+        }
         if (is_root && direntp->d_type == DT_DIR && strcmp(direntp->d_name, "..") == 0)
         {
             // Hide up directory on root.
@@ -674,6 +1653,17 @@ file_t *list_files(const char *path, int *numentries)
         }
         memset(&files[count - 1], 0, sizeof(file_t));
         strcpy(files[count - 1].filename, direntp->d_name);
+        strcpy(files[count - 1].displayname, direntp->d_name);
+        if (direntp->d_type != DT_DIR && lz4file_is_compressed(direntp->d_name))
+        {
+            // Nobody needs to know we compressed this.
+            files[count - 1].displayname[strlen(direntp->d_name) - strlen(LZ4FILE_SUFFIX)] = 0;
+        }
+        else if (direntp->d_type != DT_DIR && adpcm_is_prerendered(direntp->d_name))
+        {
+            // Or that we pre-rendered it.
+            files[count - 1].displayname[strlen(direntp->d_name) - strlen(ADPCM_SUFFIX)] = 0;
+        }
         files[count - 1].type = direntp->d_type;
     }
 
@@ -688,6 +1678,150 @@ file_t *list_files(const char *path, int *numentries)
     return files;
 }
 
+#define CLICK_SAMPLES (SAMPLERATE / 100)
+
+uint32_t *make_click()
+{
+    // A short, decaying 2kHz square wave.
+    uint32_t *click = malloc(sizeof(uint32_t) * CLICK_SAMPLES);
+    for (int i = 0; i < CLICK_SAMPLES; i++)
+    {
+        int amplitude = (8000 * (CLICK_SAMPLES - i)) / CLICK_SAMPLES;
+        int16_t sample = ((i / (SAMPLERATE / 4000)) & 1) ? amplitude : -amplitude;
+        click[i] = (uint16_t)sample | ((uint32_t)(uint16_t)sample << 16);
+    }
+
+    return click;
+}
+
+void draw_stats(int y, audiothread_instructions_t *instructions)
+{
+    pcmcache_stats_t cache;
+    pcmcache_get_stats(&cache);
+    mixer_stats_t mixer;
+    mixer_get_stats(&mixer);
+
+    video_draw_debug_text(20, y, rgb(128, 128, 255), "Decoded audio cache");
+    video_draw_debug_text(
+        20,
+        y + 8,
+        rgb(255, 255, 255),
+        "  Hits: %u\n  Misses: %u\n  Evictions: %u\n  Tracks resident: %u\n  Bytes resident: %uKB/%uKB (%s)",
+        cache.hits,
+        cache.misses,
+        cache.evictions,
+        cache.entries,
+        cache.resident / 1024,
+        cache.budget / 1024,
+        cache.compressed ? "adpcm" : "pcm"
+    );
+
+    video_draw_debug_text(20, y + 56, rgb(128, 128, 255), "Mixer");
+    video_draw_debug_text(
+        20,
+        y + 64,
+        rgb(255, 255, 255),
+        "  Active streams: %u\n  Blocks mixed: %u\n  Queue depth: %u/%u blocks (lowest %u)\n  Starvation: %u times, %u samples\n  Mix time: %uus (peak %uus)\n  Decoded in place: %uKB, copied: %uKB\n  Track gain: %u%% (peak %u), limiter: %u%% on %u blocks",
+        mixer.active_streams,
+        mixer.blocks_mixed,
+        mixer.queue_depth,
+        MIXER_QUEUE_BLOCKS,
+        mixer.min_queue_depth,
+        mixer.starvation_events,
+        mixer.starved_samples,
+        mixer.last_mix_us,
+        mixer.peak_mix_us,
+        mixer.inplace_bytes / 1024,
+        mixer.copied_bytes / 1024,
+        instructions ? (instructions->gain * 100) / MIXER_UNITY_GAIN : 100,
+        instructions ? instructions->peak : 0,
+        (mixer.limiter_gain * 100) / MIXER_LIMITER_UNITY,
+        mixer.limited_blocks
+    );
+
+    timidity_stats_t midi;
+    ATOMIC(memcpy(&midi, &timidity_stats, sizeof(midi)));
+
+    video_draw_debug_text(20, y + 136, rgb(128, 128, 255), "MIDI");
+    video_draw_debug_text(
+        20,
+        y + 144,
+        rgb(255, 255, 255),
+        "  Polyphony limit: %u\n  Active voices: %u (peak %u, song wants %u)\n  Voices stolen: %u\n  Render time: %uus/%uus",
+        midi.polyphony,
+        midi.active_voices,
+        midi.peak_voices,
+        midi.peak_demand,
+        midi.steals,
+        midi.render_us,
+        midi.budget_us
+    );
+
+    lz4file_stats_t rom;
+    lz4file_get_stats(&rom);
+
+    video_draw_debug_text(20, y + 184, rgb(128, 128, 255), "ROM FS decompression");
+    video_draw_debug_text(
+        20,
+        y + 192,
+        rgb(255, 255, 255),
+        "  Blocks decompressed: %u (cache hits %u)\n  Compressed %uKB -> %uKB\n  Throughput: %uKB/s",
+        rom.blocks_decompressed,
+        rom.cache_hits,
+        rom.compressed_bytes / 1024,
+        rom.decompressed_bytes / 1024,
+        rom.decompress_us ? (unsigned int)(((uint64_t)rom.decompressed_bytes * 1000000) / ((uint64_t)rom.decompress_us * 1024)) : 0
+    );
+
+    ttfs_stats_t ttfs[FORMAT_COUNT];
+    ATOMIC(memcpy(ttfs, ttfs_stats, sizeof(ttfs)));
+    arena_stats_t arena;
+    arena_get_stats(&arena);
+    heap_stats_t heap;
+    ATOMIC(memcpy(&heap, &heap_stats, sizeof(heap)));
+
+    video_draw_debug_text(20, y + 224, rgb(128, 128, 255), "Playback sessions");
+    video_draw_debug_text(
+        20,
+        y + 232,
+        rgb(255, 255, 255),
+        "  Arena: %uKB/%uKB (peak %uKB), %u heap fallbacks, %u leaks\n  Heap after stopping: %uKB (most %uKB)",
+        arena.used / 1024,
+        arena.size / 1024,
+        arena.peak / 1024,
+        arena.fallbacks,
+        arena.leaks,
+        heap.last / 1024,
+        heap.peak / 1024
+    );
+    for (int i = 0; i < FORMAT_COUNT; i++)
+    {
+        video_draw_debug_text(
+            20,
+            y + 248 + (8 * i),
+            rgb(255, 255, 255),
+            "  %s: first sample %uus (avg %uus, %u plays), %uKB peak",
+            format_names[i],
+            ttfs[i].last_us,
+            ttfs[i].count ? ttfs[i].total_us / ttfs[i].count : 0,
+            ttfs[i].count,
+            arena_peak[i] / 1024
+        );
+    }
+
+    video_draw_debug_text(20, y + 304, rgb(128, 128, 255), "Events");
+    for (int i = 0; i < EVENTLOG_LINES; i++)
+    {
+        char line[EVENTLOG_LINE_LENGTH];
+        if (eventlog_get(i, line) != 0)
+        {
+            break;
+        }
+
+        video_draw_debug_text(20, y + 312 + (8 * i), rgb(255, 255, 255), "  %s", line);
+    }
+}
+
 #define REPEAT_INITIAL_DELAY 500000
 #define REPEAT_SUBSEQUENT_DELAY 25000
 
@@ -740,6 +1874,38 @@ void repeat_init(unsigned int pushed_state, int *repeat_count)
     *repeat_count = timer_start(REPEAT_INITIAL_DELAY);
 }
 
+// Range and step of the live tempo control, in percent, and how far pitch can be
+// shifted each way in semitones.
+#define TEMPO_MIN 50
+#define TEMPO_MAX 200
+#define TEMPO_STEP 5
+#define PITCH_MAX_SEMITONES 12
+
+unsigned int stretch_for(int tempo, unsigned int pitch)
+{
+    // Pitch comes from the resampler, which speeds things up or slows them down as
+    // well, so this is how much the time stretcher has to make up on its own.
+    return (unsigned int)((((uint64_t)((tempo * MIXER_TEMPO_UNITY) / 100)) << 16) / pitch);
+}
+
+void apply_tempo(int *tempo, int semitones)
+{
+    unsigned int pitch = (unsigned int)(MIXER_TEMPO_UNITY * pow(2.0, semitones / 12.0));
+
+    // The time stretcher only goes so far, so pull the tempo in until the stretch it
+    // needs at this pitch is one it can do. That way what's on screen is what plays.
+    while (*tempo < TEMPO_MAX && stretch_for(*tempo, pitch) < WSOLA_MIN_TEMPO)
+    {
+        (*tempo)++;
+    }
+    while (*tempo > TEMPO_MIN && stretch_for(*tempo, pitch) > WSOLA_MAX_TEMPO)
+    {
+        (*tempo)--;
+    }
+
+    mixer_set_tempo((*tempo * MIXER_TEMPO_UNITY) / 100, pitch);
+}
+
 void main()
 {
     // Get settings so we know how many controls to read.
@@ -753,8 +1919,32 @@ void main()
     // Initialize the ROMFS.
     romfs_init_default();
 
-    // Initialize audio system.
+    // Let libraries read files we compressed at build time as if they weren't.
+    lz4file_mount();
+
+    // Initialize audio system, and start mixing music and effects into it.
     audio_init();
+    mixer_init();
+
+    // Synthesize the effect we play when moving through the file list.
+    uint32_t *click = make_click();
+
+    // Initialize the decoded audio cache.
+    pcmcache_init(PCMCACHE_BUDGET, PCMCACHE_ADPCM);
+
+    // Set aside the memory that playback sessions allocate from.
+    arena_init(ARENA_SIZE);
+
+    // Pick up the per-track gains worked out when the ROM was built.
+    loudness_init(LOUDNESS_TABLE);
+
+    // Apply whatever EQ the operator set up in test mode.
+    dsp_settings_t eq;
+    if (dsp_load(&eq, settings.game.data, settings.game.size) != 0)
+    {
+        dsp_defaults(&eq);
+    }
+    dsp_configure(&eq, MIXER_SAMPLERATE);
 
     // Set up our root directory.
     char rootpath[1024];
@@ -770,8 +1960,13 @@ void main()
     int cursor = 0;
     int top = 0;
     int repeats[4] = { -1, -1, -1, -1 };
+    int show_stats = 0;
+    int tempo = 100;
+    int semitones = 0;
     while ( 1 )
     {
+        int old_cursor = cursor;
+
         // Grab inputs.
         maple_poll_buttons();
         jvs_buttons_t pressed = maple_buttons_pressed();
@@ -828,7 +2023,37 @@ void main()
             }
         }
 
-        if (pressed.player1.start || (settings.system.players >= 2 && pressed.player2.start))
+        if (cursor != old_cursor)
+        {
+            // Give some feedback over whatever music is playing.
+            mixer_play_oneshot(click, CLICK_SAMPLES, SAMPLERATE, MIXER_UNITY_GAIN / 4);
+        }
+
+        if (pressed.player1.button1 || (settings.system.players >= 2 && pressed.player2.button1))
+        {
+            // Toggle between the file list and the statistics page.
+            show_stats = !show_stats;
+        }
+
+        if (pressed.player1.left || pressed.player1.right || (settings.system.players >= 2 && (pressed.player2.left || pressed.player2.right)))
+        {
+            // Slow down or speed up the music without changing its pitch.
+            tempo += (pressed.player1.right || (settings.system.players >= 2 && pressed.player2.right)) ? TEMPO_STEP : -TEMPO_STEP;
+            if (tempo < TEMPO_MIN) { tempo = TEMPO_MIN; }
+            if (tempo > TEMPO_MAX) { tempo = TEMPO_MAX; }
+            apply_tempo(&tempo, semitones);
+        }
+
+        if (pressed.player1.button2 || pressed.player1.button3 || (settings.system.players >= 2 && (pressed.player2.button2 || pressed.player2.button3)))
+        {
+            // Shift the pitch down or up a semitone without changing the tempo.
+            semitones += (pressed.player1.button3 || (settings.system.players >= 2 && pressed.player2.button3)) ? 1 : -1;
+            if (semitones < -PITCH_MAX_SEMITONES) { semitones = -PITCH_MAX_SEMITONES; }
+            if (semitones > PITCH_MAX_SEMITONES) { semitones = PITCH_MAX_SEMITONES; }
+            apply_tempo(&tempo, semitones);
+        }
+
+        if (!show_stats && (pressed.player1.start || (settings.system.players >= 2 && pressed.player2.start)))
         {
             if (files[cursor].type == DT_DIR)
             {
@@ -917,9 +2142,19 @@ void main()
             }
         });
 
+        // Display tempo and pitch, which apply to whatever plays.
+        video_draw_debug_text(20, 20 + (8 * 4), rgb(255, 255, 255), "Tempo: %d%%, Pitch: %s%d semitones", tempo, semitones > 0 ? "+" : "", semitones);
+
         // Display current directory.
         video_draw_debug_text(20, 20 + (8 * 5), rgb(128, 255, 128), rootpath + 5);
 
+        if (show_stats)
+        {
+            draw_stats(20 + (8 * 7), instructions);
+            video_display_on_vblank();
+            continue;
+        }
+
         for (int i = 0; i < numlines; i++)
         {
             // Figure out the actual file.
@@ -929,11 +2164,11 @@ void main()
             // Draw directories and files.
             if (files[fileoff].type == DT_DIR)
             {
-                video_draw_debug_text(20, 20 + (8 * (7 + i)), rgb(128, 128, 255), "  [ %s ]", files[fileoff].filename);
+                video_draw_debug_text(20, 20 + (8 * (7 + i)), rgb(128, 128, 255), "  [ %s ]", files[fileoff].displayname);
             }
             else
             {
-                video_draw_debug_text(20, 20 + (8 * (7 + i)), rgb(255, 255, 255), "  %s", files[fileoff].filename);
+                video_draw_debug_text(20, 20 + (8 * (7 + i)), rgb(255, 255, 255), "  %s", files[fileoff].displayname);
             }
 
             // Draw cursor.
@@ -945,14 +2180,332 @@ void main()
     }
 }
 
+#define BENCHMARK_BLOCKS 64
+
+// Clock of the SH-4, for turning benchmark times into cycles.
+#define CPU_MHZ 200
+
+// Rows on the EQ page, frequency and gain for the bass shelf and then frequency,
+// gain and width for each band.
+#define EQ_ROWS (2 + (3 * DSP_MAX_BANDS))
+#define EQ_FIELD_FREQ 0
+#define EQ_FIELD_GAIN 1
+#define EQ_FIELD_Q 2
+
+unsigned int cycles_per_sample(unsigned int total_us)
+{
+    return (unsigned int)(((uint64_t)total_us * CPU_MHZ) / (BENCHMARK_BLOCKS * MIXER_BLOCK_SAMPLES));
+}
+
+unsigned int benchmark_chain(dsp_biquad_t *chain, int stages, int32_t *accum)
+{
+    int profile = profile_start();
+    for (int i = 0; i < BENCHMARK_BLOCKS; i++)
+    {
+        for (int j = 0; j < stages; j++)
+        {
+            dsp_kernel_biquad(&chain[j], accum, MIXER_BLOCK_SAMPLES);
+        }
+    }
+    return profile_end(profile);
+}
+
+dsp_stage_settings_t *eq_row(dsp_settings_t *eq, int row, int *field)
+{
+    if (row < 2)
+    {
+        *field = row;
+        return &eq->bass;
+    }
+
+    *field = (row - 2) % 3;
+    return &eq->bands[(row - 2) / 3];
+}
+
+void eq_adjust(dsp_settings_t *eq, int row, int direction)
+{
+    int field;
+    dsp_stage_settings_t *stage = eq_row(eq, row, &field);
+
+    if (field == EQ_FIELD_FREQ)
+    {
+        // Move in roughly sixth-octave steps, fine enough to land close to anything
+        // without taking forever to sweep the whole range.
+        int freq = direction > 0 ? ((stage->freq * 112) / 100) + 1 : (stage->freq * 100) / 112;
+        if (freq < DSP_MIN_FREQ) { freq = DSP_MIN_FREQ; }
+        if (freq > DSP_MAX_FREQ) { freq = DSP_MAX_FREQ; }
+        stage->freq = freq;
+    }
+    else if (field == EQ_FIELD_GAIN)
+    {
+        int gain = stage->gain_db + direction;
+        if (gain < -DSP_MAX_GAIN_DB) { gain = -DSP_MAX_GAIN_DB; }
+        if (gain > DSP_MAX_GAIN_DB) { gain = DSP_MAX_GAIN_DB; }
+        stage->gain_db = gain;
+    }
+    else
+    {
+        int q = stage->q + direction;
+        if (q < DSP_MIN_Q) { q = DSP_MIN_Q; }
+        if (q > DSP_MAX_Q) { q = DSP_MAX_Q; }
+        stage->q = q;
+    }
+}
+
+void eq_describe(char *line, dsp_settings_t *eq, int row)
+{
+    int field;
+    dsp_stage_settings_t *stage = eq_row(eq, row, &field);
+    char name[32];
+
+    if (row < 2)
+    {
+        strcpy(name, "Bass shelf");
+    }
+    else
+    {
+        sprintf(name, "Band %d", ((row - 2) / 3) + 1);
+    }
+
+    if (field == EQ_FIELD_FREQ)
+    {
+        sprintf(line, "%s frequency: %dHz", name, stage->freq);
+    }
+    else if (field == EQ_FIELD_GAIN)
+    {
+        sprintf(line, "%s gain: %s%ddB", name, stage->gain_db > 0 ? "+" : "", stage->gain_db);
+    }
+    else
+    {
+        sprintf(line, "%s width: Q %d.%d", name, stage->q / 10, stage->q % 10);
+    }
+}
+
 void test()
 {
     video_init(VIDEO_COLOR_1555);
 
+    // Work out how much of the real-time budget each mixer voice costs, both for
+    // streams already at our rate and ones that need resampling.
+    static int32_t accum[MIXER_BLOCK_SAMPLES * 2];
+    static uint32_t out[MIXER_BLOCK_SAMPLES];
+    unsigned int block_us = (unsigned int)((1000000.0 * MIXER_BLOCK_SAMPLES) / MIXER_SAMPLERATE);
+    unsigned int direct_us = mixer_benchmark(MIXER_SAMPLERATE, BENCHMARK_BLOCKS);
+    unsigned int resampled_us = mixer_benchmark(22050, BENCHMARK_BLOCKS);
+
+    int profile = profile_start();
+    for (int i = 0; i < BENCHMARK_BLOCKS; i++)
+    {
+        mixer_kernel_saturate(out, accum, MIXER_BLOCK_SAMPLES);
+    }
+    unsigned int saturate_us = profile_end(profile) / BENCHMARK_BLOCKS;
+
+    // The output limiter costs a peak scan when it has nothing to do, and a multiply per
+    // sample when it has to pull a block down.
+    int32_t limiter = MIXER_LIMITER_UNITY;
+    profile = profile_start();
+    for (int i = 0; i < BENCHMARK_BLOCKS; i++)
+    {
+        mixer_kernel_limit(accum, MIXER_BLOCK_SAMPLES, &limiter);
+    }
+    unsigned int limit_idle_us = profile_end(profile) / BENCHMARK_BLOCKS;
+
+    for (int i = 0; i < MIXER_BLOCK_SAMPLES * 2; i++)
+    {
+        accum[i] = (i & 1) ? -65536 : 65536;
+    }
+    profile = profile_start();
+    for (int i = 0; i < BENCHMARK_BLOCKS; i++)
+    {
+        mixer_kernel_limit(accum, MIXER_BLOCK_SAMPLES, &limiter);
+    }
+    unsigned int limit_active_us = profile_end(profile) / BENCHMARK_BLOCKS;
+
+    // Pre-rendered tracks cost us nothing when the AICA decodes them, see how much
+    // it costs when it can't and we fall back to doing it ourselves.
+    static uint8_t adpcm[MIXER_BLOCK_SAMPLES / 2];
+    static int16_t decoded[MIXER_BLOCK_SAMPLES * 2];
+    for (int i = 0; i < sizeof(adpcm); i++)
+    {
+        adpcm[i] = i * 37;
+    }
+
+    adpcm_state_t adpcm_state[2];
+    adpcm_reset(&adpcm_state[0]);
+    adpcm_reset(&adpcm_state[1]);
+    profile = profile_start();
+    for (int i = 0; i < BENCHMARK_BLOCKS; i++)
+    {
+        adpcm_decode(&adpcm_state[0], decoded, 2, adpcm, 0, MIXER_BLOCK_SAMPLES);
+        adpcm_decode(&adpcm_state[1], decoded + 1, 2, adpcm, 0, MIXER_BLOCK_SAMPLES);
+    }
+    unsigned int adpcm_us = profile_end(profile) / BENCHMARK_BLOCKS;
+
+    // The time stretcher does its work in bursts, once a sequence, so feed it enough
+    // to run several and average over everything it put out.
+    static wsola_t wsola;
+    wsola_init(&wsola, (WSOLA_UNITY * 5) / 4);
+    unsigned int stretched = 0;
+
+    profile = profile_start();
+    for (int i = 0; i < BENCHMARK_BLOCKS; i++)
+    {
+        const uint32_t *samples;
+        unsigned int amount;
+
+        wsola_feed(&wsola, (uint32_t *)decoded, MIXER_BLOCK_SAMPLES);
+        while ((amount = wsola_output(&wsola, &samples)) > 0)
+        {
+            wsola_consume(&wsola, amount);
+            stretched += amount;
+        }
+    }
+    unsigned int stretch_us = stretched ? (unsigned int)(((uint64_t)profile_end(profile) * MIXER_BLOCK_SAMPLES) / stretched) : 0;
+
+    // Time each kind of EQ stage on its own and the whole chain with every stage in
+    // use, in cycles per stereo sample so it's easy to weigh against the budget.
+    static dsp_biquad_t chain[DSP_MAX_BANDS + 1];
+    dsp_design_low_shelf(&chain[0], MIXER_SAMPLERATE, 100, 6);
+    for (int i = 0; i < DSP_MAX_BANDS; i++)
+    {
+        dsp_design_peaking(&chain[i + 1], MIXER_SAMPLERATE, 250 << (2 * i), 6, 10);
+    }
+    unsigned int shelf_cycles = cycles_per_sample(benchmark_chain(&chain[0], 1, accum));
+    unsigned int band_cycles = cycles_per_sample(benchmark_chain(&chain[1], 1, accum));
+    unsigned int chain_total_us = benchmark_chain(chain, DSP_MAX_BANDS + 1, accum);
+    unsigned int chain_cycles = cycles_per_sample(chain_total_us);
+    unsigned int budget_cycles = (CPU_MHZ * 1000000) / MIXER_SAMPLERATE;
+
+    // Voices get whatever is left of a block once the output stage has run, with every
+    // EQ stage in use. A slow enough output stage leaves no room for any at all.
+    int spare_us = (int)block_us - (int)(saturate_us + limit_idle_us + (chain_total_us / BENCHMARK_BLOCKS));
+    if (spare_us < 0) { spare_us = 0; }
+    unsigned int direct_fit = direct_us ? (unsigned int)spare_us / direct_us : 0;
+    unsigned int resampled_fit = resampled_us ? (unsigned int)spare_us / resampled_us : 0;
+
+    // Load the EQ the operator saved last time, so it can be adjusted.
+    eeprom_t settings;
+    eeprom_read(&settings);
+
+    dsp_settings_t eq;
+    if (dsp_load(&eq, settings.game.data, settings.game.size) != 0)
+    {
+        dsp_defaults(&eq);
+    }
+
+    int row = 0;
+    int saved = 0;
     while ( 1 )
     {
+        maple_poll_buttons();
+        jvs_buttons_t pressed = maple_buttons_pressed();
+
+        if (pressed.player1.up && row > 0)
+        {
+            row--;
+        }
+        else if (pressed.player1.down && row < (EQ_ROWS - 1))
+        {
+            row++;
+        }
+        else if (pressed.player1.left || pressed.player1.right)
+        {
+            eq_adjust(&eq, row, pressed.player1.right ? 1 : -1);
+            dsp_configure(&eq, MIXER_SAMPLERATE);
+            saved = 0;
+        }
+        else if (pressed.player1.start)
+        {
+            int size = dsp_save(&eq, settings.game.data, sizeof(settings.game.data));
+            if (size > 0)
+            {
+                settings.game.size = size;
+                eeprom_write(&settings);
+                saved = 1;
+            }
+            else
+            {
+                saved = -1;
+            }
+        }
+
         video_fill_screen(rgb(48, 48, 48));
-        video_draw_debug_text(320 - 56, 236, rgb(255, 255, 255), "test mode stub");
+        video_draw_debug_text(
+            20,
+            20,
+            rgb(255, 255, 255),
+            "Mixer benchmark, %d samples (%uus) per block\n\n"
+            "  Stream at %dHz: %uus per block (%u.%u%%)\n"
+            "  Stream at 22050Hz: %uus per block (%u.%u%%)\n"
+            "  Output saturate: %uus per block\n"
+            "  Output limiter: %uus per block idle, %uus limiting\n\n"
+            "  Voices that fit: %u unresampled, %u resampled\n\n"
+            "  Stereo ADPCM software decode: %uus per block (%u.%u%%)\n"
+            "  Time stretch at 125%%: %uus per block (%u.%u%%)",
+            MIXER_BLOCK_SAMPLES,
+            block_us,
+            MIXER_SAMPLERATE,
+            direct_us,
+            (direct_us * 100) / block_us,
+            ((direct_us * 1000) / block_us) % 10,
+            resampled_us,
+            (resampled_us * 100) / block_us,
+            ((resampled_us * 1000) / block_us) % 10,
+            saturate_us,
+            limit_idle_us,
+            limit_active_us,
+            direct_fit,
+            resampled_fit,
+            adpcm_us,
+            (adpcm_us * 100) / block_us,
+            ((adpcm_us * 1000) / block_us) % 10,
+            stretch_us,
+            (stretch_us * 100) / block_us,
+            ((stretch_us * 1000) / block_us) % 10
+        );
+
+        unsigned int stages = eq.bass.gain_db != 0;
+        for (int i = 0; i < DSP_MAX_BANDS; i++)
+        {
+            stages += eq.bands[i].gain_db != 0;
+        }
+
+        video_draw_debug_text(
+            20,
+            20 + (8 * 14),
+            rgb(255, 255, 255),
+            "EQ benchmark, %u cycles per sample available\n\n"
+            "  Bass shelf: %u cycles per sample\n"
+            "  Peaking band: %u cycles per sample\n"
+            "  Every stage: %u cycles per sample (%u.%u%%)\n"
+            "  As configured: %u stages, about %u cycles per sample",
+            budget_cycles,
+            shelf_cycles,
+            band_cycles,
+            chain_cycles,
+            (chain_cycles * 100) / budget_cycles,
+            ((chain_cycles * 1000) / budget_cycles) % 10,
+            stages,
+            stages * band_cycles
+        );
+
+        video_draw_debug_text(20, 20 + (8 * 22), rgb(255, 255, 255), "EQ settings, up/down to pick, left/right to change, start to save");
+        for (int i = 0; i < EQ_ROWS; i++)
+        {
+            char line[64];
+            eq_describe(line, &eq, i);
+            video_draw_debug_text(20, 20 + (8 * (24 + i)), rgb(255, 255, 255), "%c %s", i == row ? '>' : ' ', line);
+        }
+        if (saved)
+        {
+            video_draw_debug_text(
+                20,
+                20 + (8 * (25 + EQ_ROWS)),
+                saved > 0 ? rgb(0, 255, 0) : rgb(255, 0, 0),
+                saved > 0 ? "Saved, takes effect from the next boot." : "Settings don't fit in the EEPROM!"
+            );
+        }
+
         video_display_on_vblank();
     }
 }
@@ -0,0 +1,736 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "midifilter.h"
+
+#define MAX_TRACKS 256
+#define MAX_VOICES 256
+
+#define VOICE_HELD 1
+#define VOICE_SUSTAINED 2
+#define VOICE_RELEASING 3
+
+typedef struct
+{
+    const uint8_t *pos;
+    const uint8_t *end;
+    uint32_t tick;
+    uint8_t running;
+    int done;
+} track_t;
+
+typedef struct
+{
+    uint8_t state;
+    uint8_t channel;
+    uint8_t note;
+    uint8_t velocity;
+    uint32_t order;
+    uint32_t started_ms;
+    uint32_t released_ms;
+} voice_t;
+
+typedef struct
+{
+    uint8_t *data;
+    unsigned int size;
+    unsigned int capacity;
+    uint32_t tick;
+    int error;
+} writer_t;
+
+typedef struct
+{
+    voice_t voices[MAX_VOICES];
+    unsigned int numvoices;
+    uint32_t order;
+
+    uint8_t volume[16];
+    uint8_t expression[16];
+    uint8_t sustain[16];
+
+    // What the song asks for, ignoring anything we stole.
+    uint8_t demand[16][128];
+    unsigned int demand_count;
+} state_t;
+
+static int read_varlen(const uint8_t **pos, const uint8_t *end, uint32_t *value)
+{
+    uint32_t result = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        if (*pos >= end)
+        {
+            return -1;
+        }
+
+        uint8_t byte = *((*pos)++);
+        result = (result << 7) | (byte & 0x7F);
+        if ((byte & 0x80) == 0)
+        {
+            *value = result;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static uint32_t read_be32(const uint8_t *data)
+{
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+static void write_bytes(writer_t *writer, const uint8_t *data, unsigned int length)
+{
+    if (writer->error)
+    {
+        return;
+    }
+
+    if (writer->size + length > writer->capacity)
+    {
+        unsigned int capacity = writer->capacity ? writer->capacity : 4096;
+        while (writer->size + length > capacity) { capacity *= 2; }
+
+        uint8_t *data = realloc(writer->data, capacity);
+        if (data == 0)
+        {
+            writer->error = 1;
+            return;
+        }
+
+        writer->data = data;
+        writer->capacity = capacity;
+    }
+
+    memcpy(writer->data + writer->size, data, length);
+    writer->size += length;
+}
+
+static void write_varlen(writer_t *writer, uint32_t value)
+{
+    uint8_t bytes[4];
+    int count = 0;
+
+    bytes[count++] = value & 0x7F;
+    while ((value >>= 7) != 0 && count < 4)
+    {
+        bytes[count++] = (value & 0x7F) | 0x80;
+    }
+
+    while (count > 0)
+    {
+        count--;
+        write_bytes(writer, &bytes[count], 1);
+    }
+}
+
+static void write_event(writer_t *writer, uint32_t tick, const uint8_t *data, unsigned int length)
+{
+    write_varlen(writer, tick - writer->tick);
+    write_bytes(writer, data, length);
+    writer->tick = tick;
+}
+
+static void write_short(writer_t *writer, uint32_t tick, uint8_t status, uint8_t data1, uint8_t data2)
+{
+    uint8_t event[3] = { status, data1, data2 };
+    write_event(writer, tick, event, 3);
+}
+
+static unsigned int loudness(state_t *state, voice_t *voice)
+{
+    return (unsigned int)voice->velocity * state->volume[voice->channel] * state->expression[voice->channel];
+}
+
+static void remove_voice(state_t *state, unsigned int index)
+{
+    state->voices[index] = state->voices[--state->numvoices];
+}
+
+static int find_voice(state_t *state, uint8_t channel, uint8_t note)
+{
+    for (unsigned int i = 0; i < state->numvoices; i++)
+    {
+        if (state->voices[i].channel == channel && state->voices[i].note == note)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void release_sustained(state_t *state, uint8_t channel, uint32_t now_ms)
+{
+    for (unsigned int i = 0; i < state->numvoices; i++)
+    {
+        if (state->voices[i].channel == channel && state->voices[i].state == VOICE_SUSTAINED)
+        {
+            state->voices[i].state = VOICE_RELEASING;
+            state->voices[i].released_ms = now_ms;
+        }
+    }
+}
+
+static void expire_voices(state_t *state, uint32_t now_ms)
+{
+    unsigned int i = 0;
+    while (i < state->numvoices)
+    {
+        voice_t *voice = &state->voices[i];
+        int drumdone = voice->channel == MIDIFILTER_DRUM_CHANNEL && (now_ms - voice->started_ms) >= MIDIFILTER_DRUM_MS;
+        int released = voice->state == VOICE_RELEASING && (now_ms - voice->released_ms) >= MIDIFILTER_RELEASE_MS;
+        if (drumdone || released)
+        {
+            remove_voice(state, i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+static int held_others(state_t *state, voice_t *voice)
+{
+    for (unsigned int i = 0; i < state->numvoices; i++)
+    {
+        voice_t *other = &state->voices[i];
+        if (other != voice && other->channel == voice->channel && other->state == VOICE_HELD)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int steal_voice(state_t *state, writer_t *writer, uint32_t tick)
+{
+    // A note off only starts a voice's release, which timidity goes on rendering, so
+    // stealing has to silence the whole channel with an all sound off. Voices on a
+    // channel with nothing else held are the cheapest to lose, then ones already
+    // releasing, then ones only ringing because of the sustain pedal, then the
+    // quietest (and on a tie the oldest) voice still being held.
+    int victim = -1;
+    int victimcost = 0;
+    for (unsigned int i = 0; i < state->numvoices; i++)
+    {
+        voice_t *voice = &state->voices[i];
+        if (voice->channel == MIDIFILTER_DRUM_CHANNEL)
+        {
+            continue;
+        }
+
+        int cost = (held_others(state, voice) * 4) + (voice->state == VOICE_HELD ? 2 : (voice->state == VOICE_SUSTAINED ? 1 : 0));
+        if (victim < 0 || cost < victimcost)
+        {
+            victim = i;
+            victimcost = cost;
+            continue;
+        }
+        if (cost > victimcost)
+        {
+            continue;
+        }
+
+        voice_t *best = &state->voices[victim];
+        unsigned int voiceloud = loudness(state, voice);
+        unsigned int bestloud = loudness(state, best);
+        if (voiceloud < bestloud || (voiceloud == bestloud && voice->order < best->order))
+        {
+            victim = i;
+        }
+    }
+
+    if (victim < 0)
+    {
+        return 0;
+    }
+
+    // Everything on the channel stops at once, so strike any other held notes again
+    // to keep them going. That only happens when no channel could be cut cleanly.
+    uint8_t channel = state->voices[victim].channel;
+    state->voices[victim].state = 0;
+    write_short(writer, tick, 0xB0 | channel, 120, 0);
+
+    unsigned int before = state->numvoices;
+    unsigned int i = 0;
+    while (i < state->numvoices)
+    {
+        voice_t *voice = &state->voices[i];
+        if (voice->channel != channel)
+        {
+            i++;
+        }
+        else if (voice->state == VOICE_HELD)
+        {
+            write_short(writer, tick, 0x90 | channel, voice->note, voice->velocity);
+            i++;
+        }
+        else
+        {
+            remove_voice(state, i);
+        }
+    }
+
+    return before - state->numvoices;
+}
+
+static void note_off(state_t *state, uint8_t channel, uint8_t note, uint32_t now_ms)
+{
+    if (state->demand[channel][note] != 0)
+    {
+        if (state->sustain[channel])
+        {
+            state->demand[channel][note] = VOICE_SUSTAINED;
+        }
+        else
+        {
+            state->demand[channel][note] = 0;
+            state->demand_count--;
+        }
+    }
+
+    int index = find_voice(state, channel, note);
+    if (index >= 0 && state->voices[index].state == VOICE_HELD)
+    {
+        if (state->sustain[channel])
+        {
+            state->voices[index].state = VOICE_SUSTAINED;
+        }
+        else
+        {
+            state->voices[index].state = VOICE_RELEASING;
+            state->voices[index].released_ms = now_ms;
+        }
+    }
+}
+
+static void pedal_up(state_t *state, uint8_t channel, uint32_t now_ms)
+{
+    for (int note = 0; note < 128; note++)
+    {
+        if (state->demand[channel][note] == VOICE_SUSTAINED)
+        {
+            state->demand[channel][note] = 0;
+            state->demand_count--;
+        }
+    }
+
+    release_sustained(state, channel, now_ms);
+}
+
+static void all_off(state_t *state, uint8_t channel, uint32_t now_ms, int immediate)
+{
+    for (int note = 0; note < 128; note++)
+    {
+        if (state->demand[channel][note] != 0)
+        {
+            state->demand[channel][note] = 0;
+            state->demand_count--;
+        }
+    }
+
+    // All sound off cuts voices dead, all notes off lets them release.
+    unsigned int i = 0;
+    while (i < state->numvoices)
+    {
+        voice_t *voice = &state->voices[i];
+        if (voice->channel != channel)
+        {
+            i++;
+        }
+        else if (immediate)
+        {
+            remove_voice(state, i);
+        }
+        else
+        {
+            if (voice->state != VOICE_RELEASING)
+            {
+                voice->state = VOICE_RELEASING;
+                voice->released_ms = now_ms;
+            }
+            i++;
+        }
+    }
+}
+
+int midifilter_apply(const uint8_t *midi, unsigned int size, unsigned int max_polyphony, midifilter_result_t *result)
+{
+    track_t *tracks = 0;
+    state_t *state = 0;
+    writer_t writer;
+
+    memset(result, 0, sizeof(midifilter_result_t));
+    memset(&writer, 0, sizeof(writer));
+
+    if (size < 14 || memcmp(midi, "MThd", 4) != 0 || read_be32(midi + 4) < 6)
+    {
+        return -1;
+    }
+
+    const uint8_t *end = midi + size;
+    unsigned int format = (midi[8] << 8) | midi[9];
+    unsigned int numtracks = (midi[10] << 8) | midi[11];
+    uint16_t division = (midi[12] << 8) | midi[13];
+    if (format > 1 || numtracks == 0 || numtracks > MAX_TRACKS || division == 0)
+    {
+        // Format 2 files are independent sequences, merging them makes no sense.
+        return -2;
+    }
+    if ((division & 0x8000) && (division & 0xFF) == 0)
+    {
+        // SMPTE timing with no subframes per frame means no ticks at all.
+        return -2;
+    }
+
+    // This can run on more than one thread at once, so nothing here can be static.
+    tracks = malloc(sizeof(track_t) * numtracks);
+    if (tracks == 0)
+    {
+        return -4;
+    }
+
+    // Find every track chunk and prime it with its first delta time.
+    const uint8_t *pos = midi + 8 + read_be32(midi + 4);
+    unsigned int found = 0;
+    while (found < numtracks && pos + 8 <= end)
+    {
+        uint32_t length = read_be32(pos + 4);
+        const uint8_t *data = pos + 8;
+        if (length > (uint32_t)(end - data))
+        {
+            // Truncated files are common enough, play what we have.
+            length = end - data;
+        }
+
+        if (memcmp(pos, "MTrk", 4) == 0)
+        {
+            track_t *track = &tracks[found++];
+            track->pos = data;
+            track->end = data + length;
+            track->tick = 0;
+            track->running = 0;
+            track->done = read_varlen(&track->pos, track->end, &track->tick) != 0;
+        }
+
+        pos = data + length;
+    }
+
+    if (found == 0)
+    {
+        free(tracks);
+        return -3;
+    }
+
+    state = malloc(sizeof(state_t));
+    if (state == 0)
+    {
+        free(tracks);
+        return -4;
+    }
+    memset(state, 0, sizeof(state_t));
+    for (int i = 0; i < 16; i++)
+    {
+        state->volume[i] = 100;
+        state->expression[i] = 127;
+    }
+
+    // Header for a single track format 0 file, the track length gets patched at the end.
+    uint8_t header[22] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, division >> 8, division & 0xFF, 'M', 'T', 'r', 'k', 0, 0, 0, 0 };
+    write_bytes(&writer, header, sizeof(header));
+
+    // Keep song time in microseconds so we can build the voice timeline.
+    uint32_t tempo = 500000;
+    uint64_t now_us = 0;
+    uint32_t last_tick = 0;
+    unsigned int timeline_capacity = 0;
+    int error = 0;
+
+    while (!error)
+    {
+        // Pick the track with the earliest pending event, ties go to the earlier track.
+        track_t *track = 0;
+        for (unsigned int i = 0; i < found; i++)
+        {
+            if (!tracks[i].done && (track == 0 || tracks[i].tick < track->tick))
+            {
+                track = &tracks[i];
+            }
+        }
+        if (track == 0)
+        {
+            break;
+        }
+
+        // Advance song time to this event.
+        if (division & 0x8000)
+        {
+            unsigned int fps = -(int8_t)(division >> 8);
+            unsigned int subframes = division & 0xFF;
+            now_us += ((uint64_t)(track->tick - last_tick) * 1000000) / (fps * subframes);
+        }
+        else
+        {
+            now_us += ((uint64_t)(track->tick - last_tick) * tempo) / division;
+        }
+        last_tick = track->tick;
+        uint32_t now_ms = now_us / 1000;
+
+        // Record how many voices were sounding up to now.
+        unsigned int bucket = now_ms / MIDIFILTER_BUCKET_MS;
+        if (bucket >= timeline_capacity)
+        {
+            unsigned int capacity = timeline_capacity ? timeline_capacity : 1024;
+            while (bucket >= capacity) { capacity *= 2; }
+
+            uint8_t *timeline = realloc(result->timeline, capacity);
+            if (timeline == 0)
+            {
+                error = -4;
+                break;
+            }
+
+            result->timeline = timeline;
+            timeline_capacity = capacity;
+        }
+        while (result->timeline_len <= bucket)
+        {
+            result->timeline[result->timeline_len++] = state->numvoices > 255 ? 255 : state->numvoices;
+        }
+
+        expire_voices(state, now_ms);
+
+        // Decode the event itself.
+        const uint8_t *event = track->pos;
+        uint8_t status = *track->pos;
+        if (status < 0x80)
+        {
+            status = track->running;
+            if (status == 0)
+            {
+                error = -5;
+                break;
+            }
+        }
+        else
+        {
+            track->pos++;
+            if (status < 0xF0) { track->running = status; }
+        }
+
+        if (status == 0xFF)
+        {
+            // Meta event.
+            if (track->pos >= track->end)
+            {
+                error = -5;
+                break;
+            }
+
+            uint8_t type = *(track->pos++);
+            uint32_t length;
+            if (read_varlen(&track->pos, track->end, &length) != 0 || length > (uint32_t)(track->end - track->pos))
+            {
+                error = -5;
+                break;
+            }
+
+            if (type == 0x2F)
+            {
+                // We write a single end of track for the merged track ourselves.
+                track->done = 1;
+                continue;
+            }
+            if (type == 0x51 && length == 3)
+            {
+                tempo = (track->pos[0] << 16) | (track->pos[1] << 8) | track->pos[2];
+            }
+            if (type == 0x01 && result->title[0] == 0)
+            {
+                uint32_t copylen = length < sizeof(result->title) - 1 ? length : sizeof(result->title) - 1;
+                memcpy(result->title, track->pos, copylen);
+                result->title[copylen] = 0;
+            }
+
+            track->pos += length;
+            write_event(&writer, track->tick, event, track->pos - event);
+        }
+        else if (status == 0xF0 || status == 0xF7)
+        {
+            // Sysex, passed through untouched.
+            uint32_t length;
+            if (read_varlen(&track->pos, track->end, &length) != 0 || length > (uint32_t)(track->end - track->pos))
+            {
+                error = -5;
+                break;
+            }
+
+            track->pos += length;
+            track->running = 0;
+            write_event(&writer, track->tick, event, track->pos - event);
+        }
+        else
+        {
+            unsigned int datalen = ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) ? 1 : 2;
+            if ((track->end - track->pos) < datalen)
+            {
+                error = -5;
+                break;
+            }
+
+            uint8_t data1 = track->pos[0] & 0x7F;
+            uint8_t data2 = datalen > 1 ? (track->pos[1] & 0x7F) : 0;
+            uint8_t channel = status & 0x0F;
+            track->pos += datalen;
+
+            int passthrough = 1;
+            switch (status & 0xF0)
+            {
+                case 0x90:
+                    if (data2 > 0)
+                    {
+                        result->notes++;
+
+                        if (state->demand[channel][data1] == 0)
+                        {
+                            state->demand_count++;
+                            if (state->demand_count > result->peak_demand) { result->peak_demand = state->demand_count; }
+                        }
+                        state->demand[channel][data1] = VOICE_HELD;
+
+                        // Striking a note that's already sounding reuses its voice.
+                        int index = find_voice(state, channel, data1);
+                        if (index >= 0)
+                        {
+                            remove_voice(state, index);
+                        }
+
+                        while (state->numvoices >= max_polyphony || state->numvoices >= MAX_VOICES)
+                        {
+                            int stolen = steal_voice(state, &writer, track->tick);
+                            if (stolen == 0)
+                            {
+                                break;
+                            }
+                            result->steals += stolen;
+                        }
+
+                        if (state->numvoices >= MAX_VOICES)
+                        {
+                            // Nothing left to steal and nowhere to track this, so drop it.
+                            passthrough = 0;
+                            break;
+                        }
+
+                        voice_t *voice = &state->voices[state->numvoices++];
+                        voice->state = VOICE_HELD;
+                        voice->channel = channel;
+                        voice->note = data1;
+                        voice->velocity = data2;
+                        voice->order = state->order++;
+                        voice->started_ms = now_ms;
+                        if (state->numvoices > result->peak_voices) { result->peak_voices = state->numvoices; }
+                    }
+                    else
+                    {
+                        note_off(state, channel, data1, now_ms);
+                    }
+                    break;
+                case 0x80:
+                    note_off(state, channel, data1, now_ms);
+                    break;
+                case 0xB0:
+                    if (data1 == 7) { state->volume[channel] = data2; }
+                    if (data1 == 11) { state->expression[channel] = data2; }
+                    if (data1 == 64)
+                    {
+                        state->sustain[channel] = data2 >= 64;
+                        if (!state->sustain[channel])
+                        {
+                            pedal_up(state, channel, now_ms);
+                        }
+                    }
+                    if (data1 == 120 || data1 == 123)
+                    {
+                        all_off(state, channel, now_ms, data1 == 120);
+                    }
+                    break;
+            }
+
+            if (passthrough)
+            {
+                uint8_t full[3] = { status, data1, data2 };
+                write_event(&writer, track->tick, full, datalen + 1);
+            }
+        }
+
+        // Pick up the delta time to this track's next event.
+        if (!track->done)
+        {
+            uint32_t delta;
+            if (track->pos >= track->end)
+            {
+                track->done = 1;
+            }
+            else if (read_varlen(&track->pos, track->end, &delta) != 0)
+            {
+                track->done = 1;
+            }
+            else
+            {
+                track->tick += delta;
+            }
+        }
+    }
+
+    free(state);
+    free(tracks);
+
+    uint8_t eot[3] = { 0xFF, 0x2F, 0x00 };
+    write_event(&writer, writer.tick, eot, sizeof(eot));
+
+    if (error || writer.error)
+    {
+        free(writer.data);
+        midifilter_free(result);
+        return error ? error : -4;
+    }
+
+    // Now that we know how long the track is, fill it in.
+    uint32_t tracklen = writer.size - sizeof(header);
+    writer.data[18] = tracklen >> 24;
+    writer.data[19] = tracklen >> 16;
+    writer.data[20] = tracklen >> 8;
+    writer.data[21] = tracklen;
+
+    result->data = writer.data;
+    result->size = writer.size;
+    result->length_ms = now_us / 1000;
+    return 0;
+}
+
+void midifilter_free(midifilter_result_t *result)
+{
+    free(result->data);
+    free(result->timeline);
+    result->data = 0;
+    result->timeline = 0;
+    result->size = 0;
+    result->timeline_len = 0;
+}
+
+unsigned int midifilter_voices_at(midifilter_result_t *result, uint32_t ms)
+{
+    unsigned int bucket = ms / MIDIFILTER_BUCKET_MS;
+    if (result->timeline == 0 || bucket >= result->timeline_len)
+    {
+        return 0;
+    }
+
+    return result->timeline[bucket];
+}
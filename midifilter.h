@@ -0,0 +1,56 @@
+#ifndef __MIDIFILTER_H
+#define __MIDIFILTER_H
+
+#include <stdint.h>
+
+// Granularity of the active voice timeline, in milliseconds of song time.
+#define MIDIFILTER_BUCKET_MS 100
+
+// GM percussion lives on MIDI channel 10, which is 9 counting from 0.
+#define MIDIFILTER_DRUM_CHANNEL 9
+
+// Drum hits frequently never get a note off, assume they're done after this long.
+#define MIDIFILTER_DRUM_MS 1000
+
+// Voices keep sounding through their release after a note off, assume they've faded
+// out after this long.
+#define MIDIFILTER_RELEASE_MS 500
+
+typedef struct
+{
+    // Rewritten standard MIDI file, ready for mid_istream_open_mem().
+    uint8_t *data;
+    unsigned int size;
+
+    // Totals over the whole song.
+    unsigned int notes;
+    unsigned int steals;
+    unsigned int peak_voices;
+    unsigned int peak_demand;
+
+    // Song length and the first text event, which is what timidity reports as its title.
+    uint32_t length_ms;
+    char title[128];
+
+    // Number of sounding voices for each MIDIFILTER_BUCKET_MS slice of the song.
+    uint8_t *timeline;
+    unsigned int timeline_len;
+} midifilter_result_t;
+
+// Merge all tracks of a standard MIDI file into a single format 0 track, while
+// making sure no more than max_polyphony keyed, sustained or releasing voices ever
+// sound at once. When a new note would go over the limit we steal a voice by
+// cutting its channel dead with an all sound off, so that timidity stops rendering
+// it instead of playing out its release. Channels with nothing else held go first,
+// then releasing and pedal-sustained voices, then the quietest held voice, and
+// drums are never stolen.
+// Returns 0 on success or a negative number if the file could not be parsed.
+int midifilter_apply(const uint8_t *midi, unsigned int size, unsigned int max_polyphony, midifilter_result_t *result);
+
+// Free everything in a result that is still allocated.
+void midifilter_free(midifilter_result_t *result);
+
+// Look up how many voices were sounding at a given point in the song.
+unsigned int midifilter_voices_at(midifilter_result_t *result, uint32_t ms);
+
+#endif
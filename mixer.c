@@ -0,0 +1,845 @@
+#include <stdint.h>
+#include <string.h>
+#include <naomi/audio.h>
+#include <naomi/thread.h>
+#include <naomi/interrupt.h>
+#include <naomi/timer.h>
+#include "mixer.h"
+#include "dsp.h"
+#include "wsola.h"
+
+// Size in bytes of the ring buffer we register with the sound hardware.
+#define MIXER_RINGBUFFER_SIZE 8192
+
+#define STREAM_FREE 0
+#define STREAM_OPENING 1
+#define STREAM_PLAYING 2
+#define STREAM_DRAINING 3
+#define STREAM_STOPPING 4
+
+// Peaks are limited to just under full scale, so what's left for saturation to
+// catch is the odd sample during the attack ramp.
+#define MIXER_LIMITER_CEILING 31000
+
+// Samples over which the limiter clamps down once a block is too loud, and how
+// quickly it recovers afterwards: each block closes 1/16th of the gap to unity.
+#define MIXER_LIMITER_ATTACK_SAMPLES 32
+#define MIXER_LIMITER_RELEASE_SHIFT 4
+
+// Number of streams that can be time-stretched at once, enough for a track and the
+// one draining out behind it.
+#define MIXER_MAX_STRETCH 2
+
+// We only run on one core, so all the SPSC queue needs is for the compiler not to
+// move the block writes past the index update that publishes them.
+#define MIXER_BARRIER() asm volatile("" ::: "memory")
+
+typedef struct
+{
+    unsigned int numsamples;
+    uint32_t samples[MIXER_QUEUE_BLOCK_SAMPLES];
+} mixer_block_t;
+
+struct mixer_stream
+{
+    // Only the mixer thread ever moves a stream back to STREAM_FREE, so that it is
+    // never in the middle of reading a slot that somebody else is reinitializing.
+    volatile int state;
+    volatile int gain;
+
+    // Resampler state, 16.16 fixed point input samples per output sample. The step
+    // is base_step adjusted for any pitch shift. Mixing straight through keeps next
+    // and frac up to date too, so that switching between the two is seamless, and
+    // resampled is set while next has been taken from the queue but not yet played.
+    uint32_t base_step;
+    uint32_t step;
+    uint32_t frac;
+    uint32_t cur;
+    uint32_t next;
+    int resampled;
+
+    // Set for one-shot effects that play out of memory instead of the queue.
+    const uint32_t *oneshot;
+    unsigned int oneshot_len;
+
+    // Lock-free single producer, single consumer queue of decoded blocks. The decoder
+    // fills the block at head and only ever advances head, the mixer plays the block
+    // at tail and only ever advances tail. Both only ever increase.
+    volatile unsigned int head;
+    volatile unsigned int tail;
+    unsigned int readpos;
+    unsigned int fill;
+    mixer_block_t queue[MIXER_QUEUE_BLOCKS];
+
+    // Set while we're starved so we count each starvation once.
+    int starving;
+
+    // Set once the decoder hands over its first block. Until then an empty queue is
+    // just a track starting up, not a decoder falling behind.
+    volatile int started;
+
+    // Time stretcher between the queue and the resampler. Once a stream needs one it
+    // keeps it until the slot is freed, at unity tempo it passes audio straight through.
+    wsola_t *stretch;
+};
+
+static mixer_stream_t streams[MIXER_MAX_STREAMS];
+static wsola_t stretchers[MIXER_MAX_STRETCH];
+static mixer_stream_t *stretch_owners[MIXER_MAX_STRETCH];
+static volatile unsigned int music_tempo = MIXER_TEMPO_UNITY;
+static volatile unsigned int music_pitch = MIXER_TEMPO_UNITY;
+static mixer_stats_t stats;
+static volatile int mixer_exit = 0;
+static uint32_t mixer_thread_id = 0;
+
+static unsigned int queue_span(mixer_stream_t *stream, const uint32_t **ptr)
+{
+    if (stream->oneshot)
+    {
+        *ptr = &stream->oneshot[stream->readpos];
+        return stream->oneshot_len - stream->readpos;
+    }
+
+    if (stream->tail == stream->head)
+    {
+        // Nothing ready yet.
+        return 0;
+    }
+
+    mixer_block_t *block = &stream->queue[stream->tail & (MIXER_QUEUE_BLOCKS - 1)];
+    *ptr = &block->samples[stream->readpos];
+    return block->numsamples - stream->readpos;
+}
+
+static void queue_consume(mixer_stream_t *stream, unsigned int numsamples)
+{
+    stream->readpos += numsamples;
+    if (stream->oneshot == 0 && stream->readpos >= stream->queue[stream->tail & (MIXER_QUEUE_BLOCKS - 1)].numsamples)
+    {
+        // Done with this block, hand it back to the decoder.
+        stream->readpos = 0;
+        MIXER_BARRIER();
+        stream->tail++;
+    }
+}
+
+void mixer_kernel_accumulate(int32_t *accum, const uint32_t *samples, unsigned int numsamples, int gain)
+{
+    // Each 32-bit word carries both channels, so we do one load per stereo pair
+    // and unroll so the SH-4 can overlap the multiplies with the loads.
+    while (numsamples >= 4)
+    {
+        uint32_t s0 = samples[0];
+        uint32_t s1 = samples[1];
+        uint32_t s2 = samples[2];
+        uint32_t s3 = samples[3];
+
+        accum[0] += ((int32_t)(int16_t)(s0 & 0xFFFF) * gain) >> 12;
+        accum[1] += ((int32_t)(int16_t)(s0 >> 16) * gain) >> 12;
+        accum[2] += ((int32_t)(int16_t)(s1 & 0xFFFF) * gain) >> 12;
+        accum[3] += ((int32_t)(int16_t)(s1 >> 16) * gain) >> 12;
+        accum[4] += ((int32_t)(int16_t)(s2 & 0xFFFF) * gain) >> 12;
+        accum[5] += ((int32_t)(int16_t)(s2 >> 16) * gain) >> 12;
+        accum[6] += ((int32_t)(int16_t)(s3 & 0xFFFF) * gain) >> 12;
+        accum[7] += ((int32_t)(int16_t)(s3 >> 16) * gain) >> 12;
+
+        accum += 8;
+        samples += 4;
+        numsamples -= 4;
+    }
+
+    while (numsamples > 0)
+    {
+        uint32_t s = samples[0];
+        accum[0] += ((int32_t)(int16_t)(s & 0xFFFF) * gain) >> 12;
+        accum[1] += ((int32_t)(int16_t)(s >> 16) * gain) >> 12;
+
+        accum += 2;
+        samples++;
+        numsamples--;
+    }
+}
+
+static inline uint32_t saturate_pair(int32_t left, int32_t right)
+{
+    if (left > 32767) { left = 32767; }
+    if (left < -32768) { left = -32768; }
+    if (right > 32767) { right = 32767; }
+    if (right < -32768) { right = -32768; }
+
+    return ((uint32_t)left & 0xFFFF) | ((uint32_t)right << 16);
+}
+
+void mixer_kernel_saturate(uint32_t *out, const int32_t *accum, unsigned int numsamples)
+{
+    while (numsamples >= 2)
+    {
+        out[0] = saturate_pair(accum[0], accum[1]);
+        out[1] = saturate_pair(accum[2], accum[3]);
+
+        out += 2;
+        accum += 4;
+        numsamples -= 2;
+    }
+
+    if (numsamples > 0)
+    {
+        out[0] = saturate_pair(accum[0], accum[1]);
+    }
+}
+
+void mixer_kernel_limit(int32_t *accum, unsigned int numsamples, int32_t *gain)
+{
+    int32_t peak = 0;
+    for (unsigned int i = 0; i < numsamples * 2; i++)
+    {
+        int32_t sample = accum[i] < 0 ? -accum[i] : accum[i];
+        if (sample > peak) { peak = sample; }
+    }
+
+    int32_t start = *gain;
+    int32_t target = peak > MIXER_LIMITER_CEILING ? (int32_t)(((int64_t)MIXER_LIMITER_CEILING << 15) / peak) : MIXER_LIMITER_UNITY;
+    int32_t end;
+    unsigned int ramp;
+    if (target < start)
+    {
+        // Too loud, clamp down quickly.
+        end = target;
+        ramp = MIXER_LIMITER_ATTACK_SAMPLES;
+    }
+    else
+    {
+        // Ease back up, but never further than this block can take.
+        end = start + ((MIXER_LIMITER_UNITY - start) >> MIXER_LIMITER_RELEASE_SHIFT);
+        if (MIXER_LIMITER_UNITY - end < (1 << MIXER_LIMITER_RELEASE_SHIFT)) { end = MIXER_LIMITER_UNITY; }
+        if (end > target) { end = target; }
+        ramp = numsamples;
+    }
+
+    *gain = end;
+    if (start == MIXER_LIMITER_UNITY && end == MIXER_LIMITER_UNITY)
+    {
+        // Nothing to do, which is almost always the case.
+        return;
+    }
+
+    if (ramp > numsamples) { ramp = numsamples; }
+    int32_t step = (end - start) / (int32_t)ramp;
+    int32_t current = start;
+    for (unsigned int i = 0; i < numsamples; i++)
+    {
+        current = i < (ramp - 1) ? current + step : end;
+        accum[i * 2] = (int32_t)(((int64_t)accum[i * 2] * current) >> 15);
+        accum[i * 2 + 1] = (int32_t)(((int64_t)accum[i * 2 + 1] * current) >> 15);
+    }
+}
+
+static unsigned int stretch_span(mixer_stream_t *stream, const uint32_t **ptr)
+{
+    wsola_t *wsola = stream->stretch;
+    unsigned int amount = wsola_output(wsola, ptr);
+
+    while (amount == 0)
+    {
+        const uint32_t *samples;
+        unsigned int available = queue_span(stream, &samples);
+        if (available == 0)
+        {
+            // Once a draining stream has nothing left queued, let the end of it through
+            // instead of leaving it stuck in the stretcher.
+            if (stream->state == STREAM_DRAINING && wsola_flush(wsola) > 0)
+            {
+                return wsola_output(wsola, ptr);
+            }
+
+            return 0;
+        }
+
+        queue_consume(stream, wsola_feed(wsola, samples, available));
+        amount = wsola_output(wsola, ptr);
+    }
+
+    return amount;
+}
+
+static unsigned int stream_span(mixer_stream_t *stream, const uint32_t **ptr)
+{
+    return stream->stretch ? stretch_span(stream, ptr) : queue_span(stream, ptr);
+}
+
+static void stream_consume(mixer_stream_t *stream, unsigned int numsamples)
+{
+    if (stream->stretch)
+    {
+        wsola_consume(stream->stretch, numsamples);
+    }
+    else
+    {
+        queue_consume(stream, numsamples);
+    }
+}
+
+static void stream_tempo(mixer_stream_t *stream)
+{
+    unsigned int tempo = music_tempo;
+    unsigned int pitch = music_pitch;
+
+    if (stream->stretch == 0)
+    {
+        if (tempo == MIXER_TEMPO_UNITY && pitch == MIXER_TEMPO_UNITY)
+        {
+            return;
+        }
+
+        for (int i = 0; i < MIXER_MAX_STRETCH; i++)
+        {
+            if (stretch_owners[i] == 0)
+            {
+                stretch_owners[i] = stream;
+                stream->stretch = &stretchers[i];
+                wsola_init(stream->stretch, WSOLA_UNITY);
+                break;
+            }
+        }
+
+        if (stream->stretch == 0)
+        {
+            // Every stretcher is busy, so this one plays as it is.
+            return;
+        }
+    }
+
+    // Pitch comes from running the stream faster or slower through the resampler,
+    // which changes its tempo too, so the stretcher makes up the difference.
+    wsola_set_tempo(stream->stretch, (unsigned int)(((uint64_t)tempo << 16) / pitch));
+    stream->step = (uint32_t)(((uint64_t)stream->base_step * pitch) >> 16);
+}
+
+static void stream_free(mixer_stream_t *stream)
+{
+    for (int i = 0; i < MIXER_MAX_STRETCH; i++)
+    {
+        if (stretch_owners[i] == stream)
+        {
+            stretch_owners[i] = 0;
+        }
+    }
+
+    stream->stretch = 0;
+    stream->state = STREAM_FREE;
+}
+
+static unsigned int mix_direct(mixer_stream_t *stream, int32_t *accum, unsigned int numsamples)
+{
+    // Source is already at our rate, so we can mix straight out of the queue.
+    unsigned int mixed = 0;
+    if (stream->resampled && numsamples > 0)
+    {
+        // Coming off the resampler, which already took this sample out of the queue.
+        mixer_kernel_accumulate(accum, &stream->next, 1, stream->gain);
+        stream->resampled = 0;
+        mixed = 1;
+    }
+
+    while (mixed < numsamples)
+    {
+        const uint32_t *samples;
+        unsigned int amount = stream_span(stream, &samples);
+        if (amount == 0)
+        {
+            break;
+        }
+        if (amount > (numsamples - mixed))
+        {
+            amount = numsamples - mixed;
+        }
+
+        mixer_kernel_accumulate(accum + (mixed * 2), samples, amount, stream->gain);
+        stream->next = samples[amount - 1];
+        stream_consume(stream, amount);
+        mixed += amount;
+    }
+
+    // Leave the resampler two samples "behind" the last one we played, so if the
+    // pitch changes it picks up with the very next sample.
+    stream->frac = 0x20000;
+    return mixed;
+}
+
+static unsigned int mix_resampled(mixer_stream_t *stream, int32_t *accum, unsigned int numsamples)
+{
+    int gain = stream->gain;
+
+    for (unsigned int i = 0; i < numsamples; i++)
+    {
+        while (stream->frac >= 0x10000)
+        {
+            const uint32_t *samples;
+            if (stream_span(stream, &samples) == 0)
+            {
+                return i;
+            }
+
+            stream->cur = stream->next;
+            stream->next = samples[0];
+            stream_consume(stream, 1);
+            stream->frac -= 0x10000;
+            stream->resampled = 1;
+        }
+
+        // Linear interpolation between the two input samples we straddle. The fraction
+        // is dropped to 15 bits so the difference times it can't overflow.
+        int32_t frac = stream->frac >> 1;
+        int32_t curleft = (int16_t)(stream->cur & 0xFFFF);
+        int32_t curright = (int16_t)(stream->cur >> 16);
+        int32_t nextleft = (int16_t)(stream->next & 0xFFFF);
+        int32_t nextright = (int16_t)(stream->next >> 16);
+        int32_t left = curleft + (((nextleft - curleft) * frac) >> 15);
+        int32_t right = curright + (((nextright - curright) * frac) >> 15);
+
+        accum[i * 2] += (left * gain) >> 12;
+        accum[i * 2 + 1] += (right * gain) >> 12;
+        stream->frac += stream->step;
+    }
+
+    return numsamples;
+}
+
+static void *mixer_thread(void *param)
+{
+    static int32_t accum[MIXER_BLOCK_SAMPLES * 2];
+    static uint32_t block[MIXER_BLOCK_SAMPLES];
+    int32_t limiter = MIXER_LIMITER_UNITY;
+
+    while (mixer_exit == 0)
+    {
+        int profile = profile_start();
+        unsigned int active = 0;
+        unsigned int starved = 0;
+        unsigned int events = 0;
+        unsigned int depth = MIXER_QUEUE_BLOCKS;
+
+        memset(accum, 0, sizeof(accum));
+        for (int i = 0; i < MIXER_MAX_STREAMS; i++)
+        {
+            mixer_stream_t *stream = &streams[i];
+            int state = stream->state;
+
+            if (state == STREAM_STOPPING)
+            {
+                stream_free(stream);
+                continue;
+            }
+            if (state != STREAM_PLAYING && state != STREAM_DRAINING)
+            {
+                continue;
+            }
+
+            active++;
+            if (stream->oneshot == 0)
+            {
+                unsigned int queued = stream->head - stream->tail;
+                if (stream->started && queued < depth) { depth = queued; }
+
+                // Effects always play as they are, only decoded streams follow the tempo.
+                stream_tempo(stream);
+            }
+
+            unsigned int mixed = stream->step == 0x10000 ?
+                mix_direct(stream, accum, MIXER_BLOCK_SAMPLES) :
+                mix_resampled(stream, accum, MIXER_BLOCK_SAMPLES);
+
+            if (mixed < MIXER_BLOCK_SAMPLES)
+            {
+                if (state == STREAM_DRAINING || stream->oneshot)
+                {
+                    // Played everything it had, give the slot back.
+                    stream_free(stream);
+                }
+                else if (stream->started)
+                {
+                    // Decoder didn't keep up with us.
+                    starved += MIXER_BLOCK_SAMPLES - mixed;
+                    if (!stream->starving)
+                    {
+                        stream->starving = 1;
+                        events++;
+                    }
+                }
+            }
+            else
+            {
+                stream->starving = 0;
+            }
+        }
+
+        // Operator EQ goes on the whole mix, and before the limiter since boosting a band
+        // can push things over full scale just as track gains can.
+        dsp_process(accum, MIXER_BLOCK_SAMPLES);
+
+        // Track gains can push loud passages over full scale, so catch those before clipping.
+        mixer_kernel_limit(accum, MIXER_BLOCK_SAMPLES, &limiter);
+        mixer_kernel_saturate(block, accum, MIXER_BLOCK_SAMPLES);
+
+        uint32_t elapsed = profile_end(profile);
+        stats.limiter_gain = limiter;
+        if (limiter < MIXER_LIMITER_UNITY) { stats.limited_blocks++; }
+        stats.active_streams = active;
+        stats.blocks_mixed++;
+        stats.starved_samples += starved;
+        stats.starvation_events += events;
+        stats.queue_depth = depth;
+        if (depth < stats.min_queue_depth) { stats.min_queue_depth = depth; }
+        stats.last_mix_us = elapsed;
+        if (elapsed > stats.peak_mix_us) { stats.peak_mix_us = elapsed; }
+
+        int numsamples = MIXER_BLOCK_SAMPLES;
+        uint32_t *samples = block;
+        while (numsamples > 0 && mixer_exit == 0)
+        {
+            int actual_written = audio_write_stereo_data(samples, numsamples);
+            if (actual_written < 0)
+            {
+                break;
+            }
+            if (actual_written < numsamples)
+            {
+                numsamples -= actual_written;
+                samples += actual_written;
+
+                // Sleep for the time it takes to play a block so we can wake up and
+                // fill it again.
+                thread_sleep((int)(1000000.0 * ((float)MIXER_BLOCK_SAMPLES / (float)MIXER_SAMPLERATE)));
+            }
+            else
+            {
+                numsamples = 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+void mixer_init()
+{
+    memset(streams, 0, sizeof(streams));
+    memset(stretch_owners, 0, sizeof(stretch_owners));
+    memset(&stats, 0, sizeof(stats));
+    stats.min_queue_depth = MIXER_QUEUE_BLOCKS;
+    stats.limiter_gain = MIXER_LIMITER_UNITY;
+    mixer_exit = 0;
+
+    audio_register_ringbuffer(AUDIO_FORMAT_16BIT, MIXER_SAMPLERATE, MIXER_RINGBUFFER_SIZE);
+
+    // We must never be starved by a decoder, so run above them.
+    mixer_thread_id = thread_create("mixer", &mixer_thread, 0);
+    thread_priority(mixer_thread_id, 2);
+    thread_start(mixer_thread_id);
+}
+
+void mixer_free()
+{
+    mixer_exit = 1;
+    thread_join(mixer_thread_id);
+    thread_destroy(mixer_thread_id);
+
+    audio_unregister_ringbuffer();
+}
+
+static mixer_stream_t *claim_stream(unsigned int samplerate, int gain)
+{
+    mixer_stream_t *stream = 0;
+    ATOMIC({
+        for (int i = 0; i < MIXER_MAX_STREAMS; i++)
+        {
+            if (streams[i].state == STREAM_FREE)
+            {
+                stream = &streams[i];
+                stream->state = STREAM_OPENING;
+                break;
+            }
+        }
+    });
+
+    if (stream)
+    {
+        stream->gain = gain;
+        stream->base_step = (uint32_t)(((uint64_t)samplerate << 16) / MIXER_SAMPLERATE);
+        stream->step = stream->base_step;
+
+        // Start two samples "behind" so the resampler pulls in a cur and next sample first.
+        stream->frac = 0x20000;
+        stream->cur = 0;
+        stream->next = 0;
+        stream->oneshot = 0;
+        stream->oneshot_len = 0;
+        stream->readpos = 0;
+        stream->head = 0;
+        stream->tail = 0;
+        stream->fill = 0;
+        stream->starving = 0;
+        stream->started = 0;
+        stream->resampled = 0;
+    }
+
+    return stream;
+}
+
+mixer_stream_t *mixer_stream_open(unsigned int samplerate, int gain)
+{
+    mixer_stream_t *stream = claim_stream(samplerate, gain);
+    if (stream)
+    {
+        stream->state = STREAM_PLAYING;
+    }
+
+    return stream;
+}
+
+int mixer_play_oneshot(const uint32_t *samples, unsigned int numsamples, unsigned int samplerate, int gain)
+{
+    mixer_stream_t *stream = claim_stream(samplerate, gain);
+    if (stream == 0)
+    {
+        return -1;
+    }
+
+    stream->oneshot = samples;
+    stream->oneshot_len = numsamples;
+    stream->state = STREAM_PLAYING;
+    return 0;
+}
+
+static mixer_block_t *producer_block(mixer_stream_t *stream)
+{
+    if ((stream->head - stream->tail) >= MIXER_QUEUE_BLOCKS)
+    {
+        // Every block is queued up waiting for the mixer.
+        return 0;
+    }
+
+    return &stream->queue[stream->head & (MIXER_QUEUE_BLOCKS - 1)];
+}
+
+static void producer_commit(mixer_stream_t *stream)
+{
+    // Make sure the samples land before the mixer can see the block.
+    stream->queue[stream->head & (MIXER_QUEUE_BLOCKS - 1)].numsamples = stream->fill;
+    stream->fill = 0;
+    MIXER_BARRIER();
+    stream->head++;
+    stream->started = 1;
+}
+
+int mixer_stream_write_stereo(mixer_stream_t *stream, uint32_t *samples, unsigned int numsamples)
+{
+    if (stream == 0 || stream->state != STREAM_PLAYING)
+    {
+        return -1;
+    }
+
+    unsigned int written = 0;
+    while (written < numsamples)
+    {
+        mixer_block_t *block = producer_block(stream);
+        if (block == 0)
+        {
+            break;
+        }
+
+        unsigned int amount = MIXER_QUEUE_BLOCK_SAMPLES - stream->fill;
+        if (amount > (numsamples - written)) { amount = numsamples - written; }
+
+        memcpy(&block->samples[stream->fill], &samples[written], amount * sizeof(uint32_t));
+        ATOMIC(stats.copied_bytes += amount * sizeof(uint32_t));
+        stream->fill += amount;
+        written += amount;
+
+        if (stream->fill == MIXER_QUEUE_BLOCK_SAMPLES)
+        {
+            producer_commit(stream);
+        }
+    }
+
+    return written;
+}
+
+int mixer_stream_write_mono(mixer_stream_t *stream, int16_t *samples, unsigned int numsamples)
+{
+    if (stream == 0 || stream->state != STREAM_PLAYING)
+    {
+        return -1;
+    }
+
+    unsigned int written = 0;
+    while (written < numsamples)
+    {
+        mixer_block_t *block = producer_block(stream);
+        if (block == 0)
+        {
+            break;
+        }
+
+        unsigned int amount = MIXER_QUEUE_BLOCK_SAMPLES - stream->fill;
+        if (amount > (numsamples - written)) { amount = numsamples - written; }
+
+        for (unsigned int i = 0; i < amount; i++)
+        {
+            uint32_t sample = (uint16_t)samples[written + i];
+            block->samples[stream->fill + i] = sample | (sample << 16);
+        }
+        ATOMIC(stats.copied_bytes += amount * sizeof(int16_t));
+        stream->fill += amount;
+        written += amount;
+
+        if (stream->fill == MIXER_QUEUE_BLOCK_SAMPLES)
+        {
+            producer_commit(stream);
+        }
+    }
+
+    return written;
+}
+
+int mixer_stream_acquire(mixer_stream_t *stream, uint32_t **samples)
+{
+    if (stream == 0 || stream->state != STREAM_PLAYING)
+    {
+        return -1;
+    }
+
+    mixer_block_t *block = producer_block(stream);
+    if (block == 0)
+    {
+        return 0;
+    }
+
+    *samples = &block->samples[stream->fill];
+    return MIXER_QUEUE_BLOCK_SAMPLES - stream->fill;
+}
+
+int mixer_stream_commit(mixer_stream_t *stream, unsigned int numsamples)
+{
+    if (stream == 0 || stream->state != STREAM_PLAYING || producer_block(stream) == 0)
+    {
+        return -1;
+    }
+    if (numsamples > MIXER_QUEUE_BLOCK_SAMPLES - stream->fill)
+    {
+        return -1;
+    }
+
+    ATOMIC(stats.inplace_bytes += numsamples * sizeof(uint32_t));
+    stream->fill += numsamples;
+    if (stream->fill == MIXER_QUEUE_BLOCK_SAMPLES)
+    {
+        producer_commit(stream);
+    }
+
+    return 0;
+}
+
+int mixer_stream_commit_mono(mixer_stream_t *stream, unsigned int numsamples)
+{
+    mixer_block_t *block = stream ? producer_block(stream) : 0;
+    if (block == 0 || numsamples > MIXER_QUEUE_BLOCK_SAMPLES - stream->fill)
+    {
+        return -1;
+    }
+
+    // Work backwards so that each stereo sample only overwrites mono samples we've
+    // already spread out.
+    uint32_t *samples = &block->samples[stream->fill];
+    int16_t *mono = (int16_t *)samples;
+    for (unsigned int i = numsamples; i > 0; i--)
+    {
+        uint32_t sample = (uint16_t)mono[i - 1];
+        samples[i - 1] = sample | (sample << 16);
+    }
+
+    return mixer_stream_commit(stream, numsamples);
+}
+
+void mixer_stream_set_gain(mixer_stream_t *stream, int gain)
+{
+    if (stream)
+    {
+        stream->gain = gain;
+    }
+}
+
+void mixer_set_tempo(unsigned int tempo, unsigned int pitch)
+{
+    if (pitch == 0)
+    {
+        pitch = MIXER_TEMPO_UNITY;
+    }
+
+    ATOMIC({
+        music_tempo = tempo;
+        music_pitch = pitch;
+    });
+}
+
+void mixer_stream_close(mixer_stream_t *stream, int drain)
+{
+    if (stream)
+    {
+        if (drain && stream->state == STREAM_PLAYING)
+        {
+            // Hand over whatever we gathered into the last partial block.
+            if (stream->fill > 0 && producer_block(stream))
+            {
+                producer_commit(stream);
+            }
+        }
+
+        stream->state = drain ? STREAM_DRAINING : STREAM_STOPPING;
+    }
+}
+
+void mixer_get_stats(mixer_stats_t *out)
+{
+    ATOMIC(memcpy(out, &stats, sizeof(stats)));
+}
+
+unsigned int mixer_benchmark(unsigned int samplerate, unsigned int blocks)
+{
+    // Mix from a one-shot source so we time exactly what the mixer thread does per stream.
+    static uint32_t source[MIXER_BLOCK_SAMPLES * 2];
+    static int32_t accum[MIXER_BLOCK_SAMPLES * 2];
+    static mixer_stream_t stream;
+
+    uint32_t seed = 12345;
+    for (int i = 0; i < MIXER_BLOCK_SAMPLES * 2; i++)
+    {
+        seed = (seed * 1103515245) + 12345;
+        source[i] = seed;
+    }
+
+    memset(&stream, 0, sizeof(stream));
+    stream.gain = MIXER_UNITY_GAIN / 2;
+    stream.step = (uint32_t)(((uint64_t)samplerate << 16) / MIXER_SAMPLERATE);
+    stream.oneshot = source;
+    stream.oneshot_len = MIXER_BLOCK_SAMPLES * 2;
+
+    int profile = profile_start();
+    for (unsigned int i = 0; i < blocks; i++)
+    {
+        // Rewind so we never run dry, a block never consumes more than twice its length.
+        stream.readpos = 0;
+        stream.frac = 0x20000;
+
+        if (stream.step == 0x10000)
+        {
+            mix_direct(&stream, accum, MIXER_BLOCK_SAMPLES);
+        }
+        else
+        {
+            mix_resampled(&stream, accum, MIXER_BLOCK_SAMPLES);
+        }
+    }
+
+    return profile_end(profile) / blocks;
+}
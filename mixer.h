@@ -0,0 +1,110 @@
+#ifndef __MIXER_H
+#define __MIXER_H
+
+#include <stdint.h>
+
+// Rate that all streams are resampled to and the ring buffer is registered at.
+#define MIXER_SAMPLERATE 44100
+
+// Number of stereo samples mixed and handed to the ring buffer at once.
+#define MIXER_BLOCK_SAMPLES 512
+
+// Maximum number of simultaneous streams, music and effects combined.
+#define MIXER_MAX_STREAMS 8
+
+// Decoders hand audio to the mixer in blocks of this many stereo samples.
+#define MIXER_QUEUE_BLOCK_SAMPLES 1024
+
+// Number of blocks of lookahead each streaming source can have queued up. Must be a power of 2.
+#define MIXER_QUEUE_BLOCKS 8
+
+// Gains are 4.12 fixed point, so this is a gain of 1.0.
+#define MIXER_UNITY_GAIN 4096
+
+// The output limiter works in 1.15 fixed point, so this is a limiter gain of 1.0.
+#define MIXER_LIMITER_UNITY 32768
+
+// Tempos and pitches are 16.16 fixed point, so this leaves a stream as it is.
+#define MIXER_TEMPO_UNITY 0x10000
+
+typedef struct mixer_stream mixer_stream_t;
+
+// Register the ring buffer and start the thread that mixes all streams into it.
+void mixer_init();
+
+// Stop mixing and hand the ring buffer back.
+void mixer_free();
+
+// Open a stream that a decoder feeds with mixer_stream_write_*() calls. Audio
+// at any rate is accepted and resampled to MIXER_SAMPLERATE. Returns 0 if all
+// stream slots are busy.
+mixer_stream_t *mixer_stream_open(unsigned int samplerate, int gain);
+
+// Queue interleaved stereo 16-bit samples or mono 16-bit samples on a stream. Like
+// audio_write_stereo_data(), these return how many samples were accepted, which can
+// be less than asked if the stream is full, or a negative number on error. Samples
+// are gathered into blocks and only whole blocks are handed to the mixer, except
+// for the last partial block which is handed over when the stream is closed.
+int mixer_stream_write_stereo(mixer_stream_t *stream, uint32_t *samples, unsigned int numsamples);
+int mixer_stream_write_mono(mixer_stream_t *stream, int16_t *samples, unsigned int numsamples);
+
+// Decode straight into a stream's queue instead of handing it samples to copy. Acquire
+// returns how many stereo 16-bit samples can be written to *samples, which is 0 if the
+// stream is full or a negative number on error. Write up to that many and hand them
+// to the mixer with commit. Mono decoders can write 16-bit samples to the start of the
+// region and call mixer_stream_commit_mono() to have them spread out in place.
+int mixer_stream_acquire(mixer_stream_t *stream, uint32_t **samples);
+int mixer_stream_commit(mixer_stream_t *stream, unsigned int numsamples);
+int mixer_stream_commit_mono(mixer_stream_t *stream, unsigned int numsamples);
+
+// Change the gain on an open stream.
+void mixer_stream_set_gain(mixer_stream_t *stream, int gain);
+
+// Speed up or slow down every decoded stream, and shift its pitch, independently of
+// each other. Tempo is stretched in time and pitch comes from the resampler. This
+// applies live to streams already playing, but never to one-shot effects.
+void mixer_set_tempo(unsigned int tempo, unsigned int pitch);
+
+// Close a stream. If drain is set, the stream keeps playing until everything already
+// queued has been heard, otherwise it is silenced immediately.
+void mixer_stream_close(mixer_stream_t *stream, int drain);
+
+// Fire and forget a one-shot effect from stereo 16-bit samples in memory. The samples
+// must stay valid until the effect finishes. Returns nonzero if no slot was free.
+int mixer_play_oneshot(const uint32_t *samples, unsigned int numsamples, unsigned int samplerate, int gain);
+
+typedef struct
+{
+    unsigned int active_streams;
+    unsigned int blocks_mixed;
+    unsigned int starved_samples;
+    unsigned int starvation_events;
+    unsigned int queue_depth;
+    unsigned int min_queue_depth;
+    unsigned int last_mix_us;
+    unsigned int peak_mix_us;
+    unsigned int copied_bytes;
+    unsigned int inplace_bytes;
+    unsigned int limiter_gain;
+    unsigned int limited_blocks;
+} mixer_stats_t;
+
+void mixer_get_stats(mixer_stats_t *stats);
+
+// Time mixing a single stream at the given source rate, returning the average
+// number of microseconds it costs per MIXER_BLOCK_SAMPLES block.
+unsigned int mixer_benchmark(unsigned int samplerate, unsigned int blocks);
+
+// The mixing kernels themselves, exposed so that test mode can benchmark them.
+// Scale a block of stereo samples by a gain and sum into a 32-bit accumulator.
+void mixer_kernel_accumulate(int32_t *accum, const uint32_t *samples, unsigned int numsamples, int gain);
+
+// Clamp an accumulator back down to stereo 16-bit samples.
+void mixer_kernel_saturate(uint32_t *out, const int32_t *accum, unsigned int numsamples);
+
+// Pull a block of the accumulator down so it fits under full scale, easing back to
+// unity over the following blocks. The limiter gain carries from block to block in
+// *gain, which should start at MIXER_LIMITER_UNITY.
+void mixer_kernel_limit(int32_t *accum, unsigned int numsamples, int32_t *gain);
+
+#endif
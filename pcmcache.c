@@ -0,0 +1,385 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <naomi/thread.h>
+#include <naomi/interrupt.h>
+#include "pcmcache.h"
+
+static pcmcache_entry_t *lru_head = 0;
+static pcmcache_entry_t *lru_tail = 0;
+static pcmcache_stats_t stats;
+
+static unsigned int chunk_capacity(pcmcache_entry_t *entry)
+{
+    // Samples per channel a chunk holds, at two a byte for ADPCM.
+    unsigned int bytes = PCMCACHE_CHUNK_BYTES / entry->channels;
+    return entry->compressed ? bytes * 2 : bytes / sizeof(int16_t);
+}
+
+static void lru_unlink(pcmcache_entry_t *entry)
+{
+    if (entry->prev) { entry->prev->next = entry->next; } else { lru_head = entry->next; }
+    if (entry->next) { entry->next->prev = entry->prev; } else { lru_tail = entry->prev; }
+    entry->prev = 0;
+    entry->next = 0;
+}
+
+static void lru_push_front(pcmcache_entry_t *entry)
+{
+    entry->prev = 0;
+    entry->next = lru_head;
+    if (lru_head) { lru_head->prev = entry; } else { lru_tail = entry; }
+    lru_head = entry;
+}
+
+static void free_chunks(pcmcache_entry_t *entry)
+{
+    pcmcache_chunk_t *chunk = entry->first;
+    while (chunk)
+    {
+        pcmcache_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    entry->first = 0;
+    entry->last = 0;
+}
+
+static pcmcache_entry_t *evict_one()
+{
+    // Must be called with interrupts disabled. Walks from the least recently used
+    // end and unlinks the first entry nobody is currently playing.
+    pcmcache_entry_t *victim = lru_tail;
+    while (victim && victim->refcount > 0)
+    {
+        victim = victim->prev;
+    }
+
+    if (victim)
+    {
+        lru_unlink(victim);
+        stats.resident -= victim->bytes;
+        stats.entries--;
+        stats.evictions++;
+    }
+
+    return victim;
+}
+
+void pcmcache_init(unsigned int budget, int compress)
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.budget = budget;
+    stats.compressed = compress;
+}
+
+pcmcache_entry_t *pcmcache_lookup(const char *filename)
+{
+    pcmcache_entry_t *found = 0;
+
+    if (stats.budget == 0)
+    {
+        return 0;
+    }
+
+    ATOMIC({
+        for (pcmcache_entry_t *entry = lru_head; entry; entry = entry->next)
+        {
+            if (strcmp(entry->filename, filename) == 0)
+            {
+                found = entry;
+                break;
+            }
+        }
+
+        if (found)
+        {
+            // Most recently used goes to the front.
+            lru_unlink(found);
+            lru_push_front(found);
+            found->refcount++;
+            stats.hits++;
+        }
+        else
+        {
+            stats.misses++;
+        }
+    });
+
+    return found;
+}
+
+pcmcache_entry_t *pcmcache_record(const char *filename, unsigned int samplerate, unsigned int channels, unsigned int numsamples)
+{
+    if (stats.budget == 0 || channels < 1 || channels > 2)
+    {
+        return 0;
+    }
+
+    pcmcache_entry_t *entry = malloc(sizeof(pcmcache_entry_t));
+    if (entry == 0)
+    {
+        return 0;
+    }
+
+    memset(entry, 0, sizeof(pcmcache_entry_t));
+    strncpy(entry->filename, filename, sizeof(entry->filename) - 1);
+    entry->samplerate = samplerate;
+    entry->channels = channels;
+    entry->compressed = stats.compressed;
+    entry->refcount = 1;
+    for (unsigned int ch = 0; ch < channels; ch++)
+    {
+        adpcm_reset(&entry->encoder[ch]);
+    }
+
+    // Don't evict everything else for a track we would only end up throwing away.
+    unsigned int capacity = chunk_capacity(entry);
+    uint64_t chunks = ((uint64_t)numsamples + capacity - 1) / capacity;
+    if (chunks * sizeof(pcmcache_chunk_t) > stats.budget)
+    {
+        free(entry);
+        return 0;
+    }
+
+    return entry;
+}
+
+int pcmcache_append(pcmcache_entry_t *entry, const int16_t *samples, unsigned int numsamples)
+{
+    if (entry == 0 || entry->abandoned)
+    {
+        return -1;
+    }
+
+    unsigned int capacity = chunk_capacity(entry);
+    unsigned int region = PCMCACHE_CHUNK_BYTES / entry->channels;
+
+    while (numsamples > 0)
+    {
+        pcmcache_chunk_t *chunk = entry->last;
+        if (chunk == 0 || chunk->numsamples == capacity)
+        {
+            // Need more room, make space in the budget by evicting old tracks first. If
+            // this track alone is already too big for the budget, give up on it instead of
+            // evicting tracks for nothing, since its length was only an estimate.
+            int fits = 0;
+            while (!fits && entry->bytes + sizeof(pcmcache_chunk_t) <= stats.budget)
+            {
+                pcmcache_entry_t *victim = 0;
+                ATOMIC({
+                    if (stats.resident + sizeof(pcmcache_chunk_t) <= stats.budget)
+                    {
+                        stats.resident += sizeof(pcmcache_chunk_t);
+                        fits = 1;
+                    }
+                    else
+                    {
+                        victim = evict_one();
+                    }
+                });
+
+                if (fits)
+                {
+                    break;
+                }
+                if (victim == 0)
+                {
+                    // Nothing left to evict, this track will never fit.
+                    break;
+                }
+
+                free_chunks(victim);
+                free(victim);
+            }
+
+            chunk = fits ? malloc(sizeof(pcmcache_chunk_t)) : 0;
+            if (chunk == 0)
+            {
+                ATOMIC({
+                    if (fits) { stats.resident -= sizeof(pcmcache_chunk_t); }
+                    stats.resident -= entry->bytes;
+                });
+                free_chunks(entry);
+                entry->bytes = 0;
+                entry->numsamples = 0;
+                entry->abandoned = 1;
+                return -1;
+            }
+
+            chunk->next = 0;
+            chunk->numsamples = 0;
+            if (entry->last) { entry->last->next = chunk; } else { entry->first = chunk; }
+            entry->last = chunk;
+            entry->bytes += sizeof(pcmcache_chunk_t);
+        }
+
+        unsigned int amount = capacity - chunk->numsamples;
+        if (amount > numsamples) { amount = numsamples; }
+
+        // Each channel gets its own part of the chunk, and as ADPCM, its own stream
+        // that carries on from one chunk into the next.
+        for (unsigned int ch = 0; ch < entry->channels; ch++)
+        {
+            uint8_t *data = chunk->data + (ch * region);
+            if (entry->compressed)
+            {
+                adpcm_encode(&entry->encoder[ch], data, chunk->numsamples, samples + ch, entry->channels, amount);
+            }
+            else
+            {
+                int16_t *out = (int16_t *)data + chunk->numsamples;
+                for (unsigned int i = 0; i < amount; i++)
+                {
+                    out[i] = samples[(i * entry->channels) + ch];
+                }
+            }
+        }
+
+        chunk->numsamples += amount;
+        entry->numsamples += amount;
+        samples += amount * entry->channels;
+        numsamples -= amount;
+    }
+
+    return 0;
+}
+
+void pcmcache_finish(pcmcache_entry_t *entry, const char *modulename, const char *tracker, int complete)
+{
+    if (entry == 0)
+    {
+        return;
+    }
+
+    if (!complete || entry->abandoned || entry->numsamples == 0)
+    {
+        ATOMIC(stats.resident -= entry->bytes);
+        free_chunks(entry);
+        free(entry);
+        return;
+    }
+
+    strncpy(entry->modulename, modulename, sizeof(entry->modulename) - 1);
+    strncpy(entry->tracker, tracker, sizeof(entry->tracker) - 1);
+    entry->complete = 1;
+
+    // Replace any stale copy of the same file and publish this one. A stale copy that
+    // is still playing can't be freed yet, so it's only taken out of the LRU so that
+    // nothing else finds it, and its last release frees it.
+    pcmcache_entry_t *stale = 0;
+    ATOMIC({
+        for (pcmcache_entry_t *other = lru_head; other; other = other->next)
+        {
+            if (strcmp(other->filename, entry->filename) == 0)
+            {
+                lru_unlink(other);
+                stats.entries--;
+                if (other->refcount > 0)
+                {
+                    other->replaced = 1;
+                }
+                else
+                {
+                    stale = other;
+                    stats.resident -= stale->bytes;
+                }
+                break;
+            }
+        }
+
+        entry->refcount--;
+        lru_push_front(entry);
+        stats.entries++;
+    });
+
+    if (stale)
+    {
+        free_chunks(stale);
+        free(stale);
+    }
+}
+
+void pcmcache_release(pcmcache_entry_t *entry)
+{
+    if (entry == 0)
+    {
+        return;
+    }
+
+    int last = 0;
+    ATOMIC({
+        entry->refcount--;
+        if (entry->replaced && entry->refcount == 0)
+        {
+            stats.resident -= entry->bytes;
+            last = 1;
+        }
+    });
+
+    if (last)
+    {
+        free_chunks(entry);
+        free(entry);
+    }
+}
+
+void pcmcache_reader_init(pcmcache_reader_t *reader, pcmcache_entry_t *entry)
+{
+    reader->entry = entry;
+    reader->chunk = entry->first;
+    reader->offset = 0;
+    for (unsigned int ch = 0; ch < entry->channels; ch++)
+    {
+        adpcm_reset(&reader->decoder[ch]);
+    }
+}
+
+unsigned int pcmcache_read(pcmcache_reader_t *reader, int16_t *out, unsigned int numsamples)
+{
+    pcmcache_entry_t *entry = reader->entry;
+    unsigned int region = PCMCACHE_CHUNK_BYTES / entry->channels;
+    unsigned int total = 0;
+
+    while (numsamples > 0 && reader->chunk != 0)
+    {
+        pcmcache_chunk_t *chunk = reader->chunk;
+        unsigned int amount = chunk->numsamples - reader->offset;
+        if (amount > numsamples) { amount = numsamples; }
+
+        for (unsigned int ch = 0; ch < entry->channels; ch++)
+        {
+            const uint8_t *data = chunk->data + (ch * region);
+            if (entry->compressed)
+            {
+                adpcm_decode(&reader->decoder[ch], out + ch, entry->channels, data, reader->offset, amount);
+            }
+            else
+            {
+                const int16_t *in = (const int16_t *)data + reader->offset;
+                for (unsigned int i = 0; i < amount; i++)
+                {
+                    out[(i * entry->channels) + ch] = in[i];
+                }
+            }
+        }
+
+        out += amount * entry->channels;
+        total += amount;
+        numsamples -= amount;
+        reader->offset += amount;
+        if (reader->offset == chunk->numsamples)
+        {
+            reader->chunk = chunk->next;
+            reader->offset = 0;
+        }
+    }
+
+    return total;
+}
+
+void pcmcache_get_stats(pcmcache_stats_t *out)
+{
+    ATOMIC(memcpy(out, &stats, sizeof(stats)));
+}
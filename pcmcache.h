@@ -0,0 +1,113 @@
+#ifndef __PCMCACHE_H
+#define __PCMCACHE_H
+
+#include <stdint.h>
+#include "adpcm.h"
+
+// Each chunk holds this many bytes of audio, split evenly between the channels. That
+// is 8192 stereo samples as plain 16-bit PCM, or 32768 stereo samples as ADPCM.
+#define PCMCACHE_CHUNK_BYTES 32768
+
+typedef struct pcmcache_chunk
+{
+    struct pcmcache_chunk *next;
+    unsigned int numsamples;
+    uint8_t data[PCMCACHE_CHUNK_BYTES];
+} pcmcache_chunk_t;
+
+typedef struct pcmcache_entry
+{
+    // LRU list links, head is the most recently used entry.
+    struct pcmcache_entry *prev;
+    struct pcmcache_entry *next;
+
+    char filename[1024];
+    char modulename[128];
+    char tracker[128];
+    unsigned int samplerate;
+    unsigned int channels;
+    unsigned int numsamples;
+    unsigned int bytes;
+
+    // Set when the audio is stored as 4-bit ADPCM instead of 16-bit PCM, along with
+    // where the encoder for each channel is at while recording.
+    int compressed;
+    adpcm_state_t encoder[2];
+
+    // Set once a recording reached the end of the track. Only complete
+    // entries are ever handed out for playback.
+    int complete;
+
+    // Set when a recording blew the budget and stopped accumulating data.
+    int abandoned;
+
+    // Set by decoders for tracks that loop forever, so that replays do too. The
+    // recording holds a single pass.
+    int loops;
+
+    // Set when a newer recording of the same file replaced this one while it was
+    // still being played. It is no longer in the LRU and goes away on its last release.
+    int replaced;
+
+    // Number of active readers or writers, entries in use are never evicted.
+    int refcount;
+
+    pcmcache_chunk_t *first;
+    pcmcache_chunk_t *last;
+} pcmcache_entry_t;
+
+typedef struct
+{
+    pcmcache_entry_t *entry;
+    pcmcache_chunk_t *chunk;
+    unsigned int offset;
+    adpcm_state_t decoder[2];
+} pcmcache_reader_t;
+
+typedef struct
+{
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int evictions;
+    unsigned int entries;
+    unsigned int resident;
+    unsigned int budget;
+    int compressed;
+} pcmcache_stats_t;
+
+// Set up the cache with a byte budget. A budget of 0 disables caching entirely. When
+// compress is set, recordings are stored as ADPCM at a quarter of the size.
+void pcmcache_init(unsigned int budget, int compress);
+
+// Look up a complete entry for a file. On a hit, the entry is returned with a
+// reference held that must be dropped with pcmcache_release().
+pcmcache_entry_t *pcmcache_lookup(const char *filename);
+
+// Start recording decoded audio for a file, given how many samples long the track
+// is expected to be, or 0 if that isn't known. Returns 0 if caching is disabled
+// or the track is too long to ever fit in the budget.
+pcmcache_entry_t *pcmcache_record(const char *filename, unsigned int samplerate, unsigned int channels, unsigned int numsamples);
+
+// Append interleaved 16-bit samples, one per channel of the recording, to a recording.
+// Returns 0 on success or -1 if the recording had to be abandoned because it would
+// not fit in the budget.
+int pcmcache_append(pcmcache_entry_t *entry, const int16_t *samples, unsigned int numsamples);
+
+// Finish a recording. Complete recordings become available to pcmcache_lookup(),
+// incomplete or abandoned recordings are thrown away.
+void pcmcache_finish(pcmcache_entry_t *entry, const char *modulename, const char *tracker, int complete);
+
+// Drop a reference taken by pcmcache_lookup().
+void pcmcache_release(pcmcache_entry_t *entry);
+
+// Start reading an entry from the beginning, which is also how a replay loops.
+void pcmcache_reader_init(pcmcache_reader_t *reader, pcmcache_entry_t *entry);
+
+// Unpack up to numsamples interleaved 16-bit samples, one per channel of the entry,
+// into out. Returns how many were unpacked, which is 0 once the end is reached.
+unsigned int pcmcache_read(pcmcache_reader_t *reader, int16_t *out, unsigned int numsamples);
+
+// Grab a snapshot of the hit/miss counters and resident bytes.
+void pcmcache_get_stats(pcmcache_stats_t *stats);
+
+#endif
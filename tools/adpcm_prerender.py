@@ -0,0 +1,540 @@
+#! /usr/bin/env python3
+# Pre-renders selected tracks in a staged ROM FS directory to the 4-bit Yamaha ADPCM
+# that the AICA sound chip decodes in hardware, so that they can be streamed to a
+# sound channel instead of being decoded by the CPU. Sources are rendered to 16-bit
+# PCM on the host (libxmp for modules, timidity for MIDI, ffmpeg for mp3 and ogg),
+# then every channel of every track is encoded on its own core.
+#
+# Each channel is one continuous ADPCM stream, starting from the state the AICA
+# starts a channel in, so it can be handed to the hardware as is. A looping track
+# has to arrive back at its loop start in exactly the decoder state it left it in.
+# We get that by encoding the loop again from the state its first pass ended in,
+# and so on until a pass settles into the same encoder state as the one before it,
+# which happens within a few seconds of audio. From there on the two passes are
+# byte for byte the same, so the loop is moved to start at that point in the
+# earlier pass and end at the same point in the later one.
+#
+# File layout, all values little endian:
+#
+#   "ADPC"
+#   uint32 sample rate
+#   uint32 channels
+#   uint32 samples per channel
+#   uint32 loop start sample, or 0xFFFFFFFF if the track doesn't loop
+#   uint32 loop end sample
+#   uint32 samples per chunk
+#   char title[128]
+#   char source format[16]
+#   chunks, each holding samples per chunk / 2 bytes for every channel in turn,
+#   two samples a byte with the earlier one in the low nibble
+import argparse
+import array
+import ctypes
+import json
+import math
+import multiprocessing
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+from concurrent.futures import ThreadPoolExecutor
+from typing import Dict, List, Optional, Tuple
+
+
+SUFFIX = ".adp"
+CHUNK_SAMPLES = 4096
+NO_LOOP = 0xFFFFFFFF
+
+# How many extra times we'll encode a loop waiting for the encoder state to settle.
+MAX_LOOP_PASSES = 8
+
+# Modules always loop, but give up looking for where after this long.
+MAX_MODULE_SECONDS = 30 * 60
+
+MIDI = {".mid", ".midi"}
+MODULES = {".mod", ".s3m", ".xm", ".it"}
+ELIGIBLE = MIDI | MODULES | {".mp3", ".ogg"}
+
+# Step size multipliers, in 1/256ths, indexed by the magnitude bits of a nibble.
+SCALE = [230, 230, 230, 230, 307, 409, 512, 614]
+STEP_MIN = 127
+STEP_MAX = 24576
+
+
+def decode_nibble(prev: int, step: int, nibble: int) -> Tuple[int, int]:
+    diff = (step * (((nibble & 7) * 2) + 1)) >> 3
+    if nibble & 8:
+        prev = max(-32768, prev - diff)
+    else:
+        prev = min(32767, prev + diff)
+    step = (step * SCALE[nibble & 7]) >> 8
+    return prev, min(STEP_MAX, max(STEP_MIN, step))
+
+
+def encode_nibble(sample: int, prev: int, step: int) -> int:
+    delta = sample - prev
+    nibble = min(7, (abs(delta) * 4) // step)
+    return nibble | 8 if delta < 0 else nibble
+
+
+def encode_run(pcm: array.array, state: List[int], history: Optional[Tuple[array.array, array.array]]) -> Tuple[bytes, Tuple[array.array, array.array], Optional[int]]:
+    # Encode a run of samples one nibble a byte, carrying the encoder state in and out.
+    # Returns the decoder state after every sample, and if we were given the states of
+    # an earlier pass over the same samples, the first point after which both match.
+    prev, step = state
+    out = bytearray(len(pcm))
+    prevs = array.array("i", bytes(4 * len(pcm)))
+    steps = array.array("i", bytes(4 * len(pcm)))
+    merged = None
+    for i, sample in enumerate(pcm):
+        nibble = encode_nibble(sample, prev, step)
+        prev, step = decode_nibble(prev, step, nibble)
+        out[i] = nibble
+        prevs[i] = prev
+        steps[i] = step
+        if merged is None and history is not None and history[0][i] == prev and history[1][i] == step:
+            merged = i + 1
+    state[0] = prev
+    state[1] = step
+    return bytes(out), (prevs, steps), merged
+
+
+def encode_channel(job: Tuple[bytes, int, int, int, int]) -> Tuple[List[bytes], int, int, int, int]:
+    # Encode one channel, returning its intro followed by each pass of the loop, which
+    # pass settled into the one before it and where, and the signal and error energy
+    # of what the decoder reconstructs on the way through, for working out SNR.
+    raw, channels, channel, loop_start, loop_end = job
+    samples = array.array("h")
+    samples.frombytes(raw)
+    if sys.byteorder != "little":
+        samples.byteswap()
+    pcm = samples[channel::channels]
+
+    state = [0, STEP_MIN]
+    if loop_start == NO_LOOP:
+        passes = [encode_run(pcm, state, None)[0]]
+        settled = 0
+        merged = 0
+    else:
+        intro = encode_run(pcm[:loop_start], state, None)[0]
+        body, history, _ = encode_run(pcm[loop_start:loop_end], state, None)
+        passes = [intro, body]
+        settled = -1
+        merged = 0
+        for count in range(2, MAX_LOOP_PASSES + 2):
+            body, history, point = encode_run(pcm[loop_start:loop_end], state, history)
+            passes.append(body)
+            if point is not None:
+                settled = count
+                merged = point
+                break
+
+    # Measure against the first time through, the later passes sound the same.
+    signal = 0
+    noise = 0
+    prev = 0
+    step = STEP_MIN
+    for sample, nibble in zip(pcm, b"".join(passes[:2])):
+        prev, step = decode_nibble(prev, step, nibble)
+        signal += sample * sample
+        noise += (sample - prev) * (sample - prev)
+    return passes, settled, merged, signal, noise
+
+
+def pack_nibbles(nibbles: bytes) -> bytes:
+    if len(nibbles) & 1:
+        nibbles += b"\x00"
+    return bytes(nibbles[i] | (nibbles[i + 1] << 4) for i in range(0, len(nibbles), 2))
+
+
+def probe(path: str, ffprobe: str) -> Tuple[Dict[str, str], int]:
+    # Grab whatever tags ffprobe can find, keys lowercased, and the source sample rate.
+    try:
+        result = subprocess.run(
+            [ffprobe, "-v", "quiet", "-print_format", "json", "-show_entries", "format_tags:stream_tags:stream=sample_rate", path],
+            check=True,
+            capture_output=True,
+        )
+    except (OSError, subprocess.CalledProcessError):
+        return {}, 0
+
+    info = json.loads(result.stdout or b"{}")
+    tags: Dict[str, str] = {}
+    srcrate = 0
+    for stream in info.get("streams", []):
+        srcrate = srcrate or int(stream.get("sample_rate", 0))
+        for key, value in stream.get("tags", {}).items():
+            tags[key.lower()] = value
+    for key, value in info.get("format", {}).get("tags", {}).items():
+        tags[key.lower()] = value
+    return tags, srcrate
+
+
+def render(path: str, romfs: str, rate: int, args: argparse.Namespace) -> bytes:
+    # Returns interleaved stereo 16-bit PCM at the requested rate.
+    if os.path.splitext(path)[1].lower() in MIDI:
+        # The config refers to patches by their ROM FS path, point it at the staged copy instead.
+        with open(os.path.join(romfs, "timidity", "timidity.cfg"), "r") as cfp:
+            config = cfp.read().replace("rom://", os.path.abspath(romfs) + "/")
+        with tempfile.NamedTemporaryFile("w", suffix=".cfg", delete=False) as tfp:
+            tfp.write(config)
+            cfgname = tfp.name
+        try:
+            command = [args.timidity, "-c", cfgname, "-Or1sl", "-s", str(rate), "-o", "-", path]
+            return subprocess.run(command, check=True, capture_output=True).stdout
+        finally:
+            os.remove(cfgname)
+
+    command = [args.ffmpeg, "-v", "error", "-i", path, "-f", "s16le", "-acodec", "pcm_s16le", "-ac", "2", "-ar", str(rate), "-"]
+    return subprocess.run(command, check=True, capture_output=True).stdout
+
+
+# Just enough of libxmp's public structures to render a module and follow it around.
+XMP_PLAYER_INTERP = 2
+XMP_PLAYER_DSP = 3
+XMP_INTERP_SPLINE = 2
+XMP_DSP_LOWPASS = 1
+XMP_MAX_CHANNELS = 64
+
+
+class XmpFrameInfo(ctypes.Structure):
+    _fields_ = [
+        (name, ctypes.c_int)
+        for name in ("pos", "pattern", "row", "num_rows", "frame", "speed", "bpm", "time", "total_time", "frame_time")
+    ] + [("buffer", ctypes.c_void_p)] + [
+        (name, ctypes.c_int)
+        for name in ("buffer_size", "total_size", "volume", "loop_count", "virt_channels", "virt_used", "sequence")
+    ] + [("channel_info", ctypes.c_ubyte * (24 * XMP_MAX_CHANNELS))]
+
+
+class XmpModule(ctypes.Structure):
+    _fields_ = [("name", ctypes.c_char * 64), ("type", ctypes.c_char * 64)]
+
+
+class XmpModuleInfo(ctypes.Structure):
+    _fields_ = [
+        ("md5", ctypes.c_ubyte * 16),
+        ("vol_base", ctypes.c_int),
+        ("mod", ctypes.POINTER(XmpModule)),
+        ("comment", ctypes.c_char_p),
+        ("num_sequences", ctypes.c_int),
+        ("seq_data", ctypes.c_void_p),
+    ]
+
+
+def render_module(path: str, rate: int, library: str) -> Tuple[bytes, Optional[Tuple[int, int]], str]:
+    # Render a module once through with libxmp, the library that plays it on the
+    # Naomi, at the quality it starts at there. Modules never end, libxmp jumps back
+    # to the restart position or wherever the song's own jump takes it, so we stop
+    # at the first frame after that happens and loop back to where that frame first
+    # played. Returns interleaved stereo 16-bit PCM, the loop and the module title.
+    xmp = ctypes.CDLL(library)
+    xmp.xmp_create_context.restype = ctypes.c_void_p
+    for name in ("xmp_free_context", "xmp_release_module", "xmp_end_player", "xmp_play_frame"):
+        getattr(xmp, name).argtypes = [ctypes.c_void_p]
+    xmp.xmp_load_module.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+    xmp.xmp_start_player.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int]
+    xmp.xmp_set_player.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int]
+    xmp.xmp_get_module_info.argtypes = [ctypes.c_void_p, ctypes.POINTER(XmpModuleInfo)]
+    xmp.xmp_get_frame_info.argtypes = [ctypes.c_void_p, ctypes.POINTER(XmpFrameInfo)]
+
+    ctx = xmp.xmp_create_context()
+    if xmp.xmp_load_module(ctx, path.encode("utf-8")) < 0:
+        xmp.xmp_free_context(ctx)
+        raise Exception(f"libxmp couldn't load {path}")
+
+    pcm = bytearray()
+    loop = None
+    try:
+        if xmp.xmp_start_player(ctx, rate, 0) != 0:
+            raise Exception(f"libxmp couldn't play {path}")
+        xmp.xmp_set_player(ctx, XMP_PLAYER_INTERP, XMP_INTERP_SPLINE)
+        xmp.xmp_set_player(ctx, XMP_PLAYER_DSP, XMP_DSP_LOWPASS)
+
+        info = XmpModuleInfo()
+        xmp.xmp_get_module_info(ctx, ctypes.byref(info))
+        title = info.mod.contents.name.decode("ascii", "replace").strip()
+
+        # Where each row was first heard, in samples.
+        rows: Dict[Tuple[int, int], int] = {}
+        frame = XmpFrameInfo()
+        while len(pcm) < MAX_MODULE_SECONDS * rate * 4 and xmp.xmp_play_frame(ctx) == 0:
+            xmp.xmp_get_frame_info(ctx, ctypes.byref(frame))
+            if frame.loop_count > 0:
+                if (frame.pos, frame.row) in rows:
+                    loop = (rows[(frame.pos, frame.row)], len(pcm) // 4)
+                break
+            rows.setdefault((frame.pos, frame.row), len(pcm) // 4)
+            pcm += ctypes.string_at(frame.buffer, frame.buffer_size)
+        xmp.xmp_end_player(ctx)
+    finally:
+        xmp.xmp_release_module(ctx)
+        xmp.xmp_free_context(ctx)
+
+    return bytes(pcm), loop, title or os.path.basename(path)
+
+
+def midi_loop(path: str) -> Optional[Tuple[float, Optional[float]]]:
+    # Find loop points in a MIDI file, in seconds. We understand the two common
+    # conventions, "loopStart" and "loopEnd" marker events, and controller 111 marking
+    # the loop start, in which case the song loops from its end.
+    with open(path, "rb") as bfp:
+        data = bfp.read()
+    if len(data) < 14 or data[0:4] != b"MThd":
+        return None
+    numtracks, division = struct.unpack(">HH", data[10:14])
+    if division & 0x8000:
+        return None
+
+    tempos: List[Tuple[int, int]] = []
+    starts: List[int] = []
+    ends: List[int] = []
+    pos = 8 + struct.unpack(">I", data[4:8])[0]
+    for _ in range(numtracks):
+        if pos + 8 > len(data) or data[pos:pos + 4] != b"MTrk":
+            break
+        end = min(len(data), pos + 8 + struct.unpack(">I", data[pos + 4:pos + 8])[0])
+        pos += 8
+        tick = 0
+        status = 0
+
+        def varlen() -> int:
+            nonlocal pos
+            value = 0
+            while pos < end:
+                byte = data[pos]
+                pos += 1
+                value = (value << 7) | (byte & 0x7F)
+                if not byte & 0x80:
+                    break
+            return value
+
+        while pos < end:
+            tick += varlen()
+            if pos >= end:
+                break
+            if data[pos] & 0x80:
+                status = data[pos]
+                pos += 1
+            if status == 0xFF:
+                kind = data[pos]
+                pos += 1
+                length = varlen()
+                payload = data[pos:pos + length]
+                pos += length
+                if kind == 0x51 and length == 3:
+                    tempos.append((tick, (payload[0] << 16) | (payload[1] << 8) | payload[2]))
+                elif kind in (0x01, 0x06) and payload.strip().lower() == b"loopstart":
+                    starts.append(tick)
+                elif kind in (0x01, 0x06) and payload.strip().lower() == b"loopend":
+                    ends.append(tick)
+            elif status in (0xF0, 0xF7):
+                pos += varlen()
+            elif (status & 0xF0) in (0xC0, 0xD0):
+                pos += 1
+            else:
+                if (status & 0xF0) == 0xB0 and pos < end and data[pos] == 111:
+                    starts.append(tick)
+                pos += 2
+        pos = end
+
+    if not starts:
+        return None
+
+    def seconds(target: int) -> float:
+        total = 0.0
+        last = 0
+        tempo = 500000
+        for tick, value in sorted(tempos):
+            if tick >= target:
+                break
+            total += (tick - last) * tempo / (division * 1000000.0)
+            last = tick
+            tempo = value
+        return total + (target - last) * tempo / (division * 1000000.0)
+
+    return seconds(min(starts)), seconds(max(ends)) if ends else None
+
+
+def render_track(path: str, romfs: str, rate: int, args: argparse.Namespace) -> Tuple[bytes, Optional[Tuple[int, int]], str]:
+    # Like render(), but also returns the loop the source describes, in samples, and a title.
+    ext = os.path.splitext(path)[1].lower()
+    if ext in MODULES:
+        return render_module(path, rate, args.libxmp)
+
+    pcm = render(path, romfs, rate, args)
+    loop = None
+    if ext in MIDI:
+        found = midi_loop(path)
+        if found is not None:
+            numsamples = len(pcm) // 4
+            loop = (int(found[0] * rate), int(found[1] * rate) if found[1] is not None else numsamples)
+    return pcm, loop, os.path.basename(path)
+
+
+def loop_points(
+    spec: Optional[str], tags: Dict[str, str], srcrate: int, found: Optional[Tuple[int, int]], rate: int, numsamples: int
+) -> Tuple[int, int]:
+    if spec:
+        # Given on the command line in seconds, as start-end.
+        start, end = spec.split("-", 1)
+        loop_start = int(float(start) * rate)
+        loop_end = int(float(end) * rate) if end else numsamples
+    elif "loopstart" in tags:
+        # The usual tag convention for looping game music, in samples at the source rate.
+        srcrate = srcrate or rate
+        loop_start = int(tags["loopstart"]) * rate // srcrate
+        if "looplength" in tags:
+            loop_end = loop_start + int(tags["looplength"]) * rate // srcrate
+        elif "loopend" in tags:
+            loop_end = int(tags["loopend"]) * rate // srcrate
+        else:
+            loop_end = numsamples
+    elif found is not None:
+        # Whatever the song itself says, which for modules is where libxmp jumped back to.
+        loop_start, loop_end = found
+    else:
+        return NO_LOOP, numsamples
+
+    # Loops have to start and end on a whole byte of nibbles.
+    loop_start &= ~1
+    loop_end = min(loop_end, numsamples) & ~1
+    if loop_start >= loop_end:
+        raise Exception(f"Loop start {loop_start} is not before loop end {loop_end}")
+    return loop_start, loop_end
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Pre-render tracks in a staged ROM FS directory to ADPCM in place.")
+    parser.add_argument("directory", metavar="DIR", type=str, help="Staged ROM FS directory.")
+    parser.add_argument(
+        "tracks",
+        metavar="TRACK",
+        type=str,
+        nargs="*",
+        help="Track to pre-render, relative to the ROM FS. Add @start-end in seconds to set loop points.",
+    )
+    parser.add_argument("--rate", type=int, default=44100, help="Sample rate to render at.")
+    parser.add_argument("--jobs", type=int, default=os.cpu_count() or 1, help="Number of encoder processes.")
+    parser.add_argument("--ffmpeg", type=str, default="ffmpeg", help="ffmpeg binary, used for modules, mp3 and ogg.")
+    parser.add_argument("--ffprobe", type=str, default="ffprobe", help="ffprobe binary, used for titles and loop tags.")
+    parser.add_argument("--timidity", type=str, default="timidity", help="timidity binary, used for MIDI.")
+    parser.add_argument("--libxmp", type=str, default="libxmp.so.4", help="libxmp shared library, used for modules.")
+    args = parser.parse_args()
+
+    selected: List[Tuple[str, Optional[str]]] = []
+    for track in args.tracks:
+        name, _, spec = track.partition("@")
+        path = os.path.join(args.directory, name)
+        if os.path.splitext(name)[1].lower() not in ELIGIBLE:
+            raise Exception(f"Don't know how to render {name}")
+        if not os.path.isfile(path):
+            raise Exception(f"Can't find {name} in {args.directory}")
+        selected.append((path, spec or None))
+
+    if not selected:
+        return 0
+
+    # Rendering is done by external tools and libxmp, which let go of the GIL while
+    # they work, so just run a bunch of them at once.
+    start = time.monotonic()
+    with ThreadPoolExecutor(max_workers=args.jobs) as pool:
+        rendered = list(pool.map(lambda track: render_track(track[0], args.directory, args.rate, args), selected))
+    render_time = time.monotonic() - start
+
+    # Every channel is one continuous stream, so each one is a job for a core.
+    jobs = []
+    tracks = []
+    for (path, spec), (pcm, found, title) in zip(selected, rendered):
+        channels = 2
+        numsamples = len(pcm) // (2 * channels)
+        source = os.path.splitext(path)[1][1:].lower()
+        tags, srcrate = ({}, 0) if ("." + source) in MIDI | MODULES else probe(path, args.ffprobe)
+        loop_start, loop_end = loop_points(spec, tags, srcrate, found, args.rate, numsamples)
+        if loop_start != NO_LOOP:
+            # Nothing after the loop end is ever heard.
+            numsamples = loop_end
+
+        title = tags.get("title", title)
+        if "artist" in tags:
+            title = f"{tags['artist']} - {title}"
+
+        pcm = pcm[:numsamples * 2 * channels]
+        tracks.append((path, channels, loop_start, loop_end, title, source, len(pcm)))
+        jobs.extend((pcm, channels, channel, loop_start, loop_end) for channel in range(channels))
+
+    start = time.monotonic()
+    with multiprocessing.Pool(args.jobs) as pool:
+        encoded = pool.map(encode_channel, jobs)
+    encode_time = time.monotonic() - start
+
+    total_samples = 0
+    total_signal = 0
+    total_noise = 0
+    index = 0
+    for path, channels, loop_start, loop_end, title, source, pcmbytes in tracks:
+        results = encoded[index:index + channels]
+        index += channels
+
+        if loop_start == NO_LOOP:
+            streams = [b"".join(result[0]) for result in results]
+        elif any(result[1] < 0 for result in results):
+            # The decoder will come back around in a slightly different state, which
+            # the software decoder shrugs off but may click on the hardware.
+            print(f"{os.path.relpath(path, args.directory)}: loop never settled, loop point may click")
+            streams = [b"".join(result[0][:2]) for result in results]
+        else:
+            # Move the loop to where the last pass settled, in every channel at once.
+            # Channels that settled sooner would just repeat their last pass from here.
+            count = max(result[1] for result in results)
+            merged = max(result[2] for result in results if result[1] == count)
+            merged = (merged + 1) & ~1
+            length = loop_end - loop_start
+            streams = []
+            for result in results:
+                passes = result[0] + [result[0][-1]] * (count + 1 - len(result[0]))
+                streams.append(b"".join(passes[:count]) + passes[count][:merged])
+            loop_start += ((count - 2) * length) + merged
+            loop_end = loop_start + length
+
+        numsamples = len(streams[0])
+        chunkbytes = CHUNK_SAMPLES // 2
+        packed = [pack_nibbles(stream) for stream in streams]
+        chunks = (len(packed[0]) + chunkbytes - 1) // chunkbytes
+        body = bytearray()
+        for chunk in range(chunks):
+            for channel in range(channels):
+                # Pad the end with nibbles that hold the decoder steady.
+                body += packed[channel][chunk * chunkbytes:(chunk + 1) * chunkbytes].ljust(chunkbytes, b"\x80")
+
+        header = b"ADPC" + struct.pack("<6I", args.rate, channels, numsamples, loop_start, loop_end, CHUNK_SAMPLES)
+        header += title.encode("ascii", "replace")[:127].ljust(128, b"\0")
+        header += source.encode("ascii")[:15].ljust(16, b"\0")
+        data = header + bytes(body)
+        with open(path + SUFFIX, "wb") as bfp:
+            bfp.write(data)
+        os.remove(path)
+
+        signal = sum(result[3] for result in results)
+        noise = sum(result[4] for result in results)
+        total_samples += pcmbytes // (2 * channels)
+        total_signal += signal
+        total_noise += noise
+        snr = 10.0 * math.log10(signal / noise) if noise else float("inf")
+        looping = f", loops {loop_start / args.rate:.2f}-{loop_end / args.rate:.2f}s" if loop_start != NO_LOOP else ""
+        print(f"{os.path.relpath(path, args.directory)}: {pcmbytes // (2 * channels) / args.rate:.1f}s{looping}, {pcmbytes} -> {len(data)} bytes, SNR {snr:.1f}dB")
+
+    snr = 10.0 * math.log10(total_signal / total_noise) if total_noise else float("inf")
+    seconds = total_samples / args.rate
+    print(
+        f"Pre-rendered {len(tracks)} tracks ({seconds:.1f}s of audio) in {render_time:.1f}s, "
+        f"encoded in {encode_time:.2f}s on {args.jobs} processes "
+        f"({total_samples / encode_time / 1000.0:.0f}K samples/s, {seconds / encode_time:.1f}x real time), SNR {snr:.1f}dB"
+    )
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
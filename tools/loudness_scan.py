@@ -0,0 +1,132 @@
+#! /usr/bin/env python3
+# Measures how loud every playable track in a staged ROM FS directory is, and
+# writes the gain that brings each one to a common level, along with its peak,
+# to loudness.txt at the root of the ROM FS. Loudness is measured the way
+# ReplayGain does it: high-pass the audio to discount bass the ear barely hears,
+# take the mean square over 50ms windows, and use the window that 95% of the
+# track is quieter than. Tracks are rendered with the same host tools that
+# adpcm_prerender.py uses and analyzed on every core in parallel.
+#
+# Each line of loudness.txt is:
+#
+#   <gain, 4.12 fixed point> <peak, 16-bit> <path relative to the ROM FS>
+import argparse
+import array
+import math
+import multiprocessing
+import os
+import sys
+from typing import List, Optional, Tuple
+
+from adpcm_prerender import ELIGIBLE, render
+
+
+OUTPUT = "loudness.txt"
+RATE = 44100
+WINDOW = RATE * 50 // 1000
+PERCENTILE = 0.95
+
+# Cutoff of the high-pass, ReplayGain uses a 2nd order Butterworth at 150Hz.
+HIGHPASS = 150.0
+
+# Limits on how far we'll push a track. The player also caps the boost so that the
+# peak written alongside it stays under full scale.
+MIN_GAIN_DB = -24.0
+MAX_GAIN_DB = 12.0
+
+
+def highpass() -> Tuple[float, float, float, float, float]:
+    k = math.tan(math.pi * HIGHPASS / RATE)
+    norm = 1.0 / (1.0 + math.sqrt(2.0) * k + k * k)
+    b0 = norm
+    return b0, -2.0 * b0, b0, 2.0 * (k * k - 1.0) * norm, (1.0 - math.sqrt(2.0) * k + k * k) * norm
+
+
+def analyze(pcm: bytes) -> Tuple[Optional[float], int]:
+    # Returns the loudness in dB relative to full scale, and the peak sample.
+    samples = array.array("h")
+    samples.frombytes(pcm[:len(pcm) - (len(pcm) % 4)])
+    if sys.byteorder != "little":
+        samples.byteswap()
+    if not samples:
+        return None, 0
+
+    peak = max(max(samples), -min(samples))
+    b0, b1, b2, a1, a2 = highpass()
+
+    lx1 = lx2 = ly1 = ly2 = 0.0
+    rx1 = rx2 = ry1 = ry2 = 0.0
+    energies: List[float] = []
+    energy = 0.0
+    count = 0
+    for i in range(0, len(samples), 2):
+        left = samples[i]
+        right = samples[i + 1]
+
+        ly = b0 * left + b1 * lx1 + b2 * lx2 - a1 * ly1 - a2 * ly2
+        lx2, lx1, ly2, ly1 = lx1, left, ly1, ly
+        ry = b0 * right + b1 * rx1 + b2 * rx2 - a1 * ry1 - a2 * ry2
+        rx2, rx1, ry2, ry1 = rx1, right, ry1, ry
+
+        energy += ly * ly + ry * ry
+        count += 1
+        if count == WINDOW:
+            energies.append(energy / (2 * WINDOW))
+            energy = 0.0
+            count = 0
+
+    if not energies:
+        return None, peak
+
+    energies.sort()
+    loudest = energies[min(len(energies) - 1, int(len(energies) * PERCENTILE))]
+    if loudest <= 0.0:
+        return None, peak
+    return 10.0 * math.log10(loudest / (32768.0 * 32768.0)), peak
+
+
+def scan(job: Tuple[str, argparse.Namespace]) -> Tuple[str, Optional[float], int]:
+    path, args = job
+    loudness, peak = analyze(render(path, args.directory, RATE, args))
+    return path, loudness, peak
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Work out per-track gains for every playable track in a staged ROM FS directory.")
+    parser.add_argument("directory", metavar="DIR", type=str, help="Staged ROM FS directory.")
+    parser.add_argument("--target", type=float, default=-18.0, help="Loudness to bring every track to, in dB relative to full scale.")
+    parser.add_argument("--jobs", type=int, default=os.cpu_count() or 1, help="Number of analysis processes.")
+    parser.add_argument("--ffmpeg", type=str, default="ffmpeg", help="ffmpeg binary, used for modules, mp3 and ogg.")
+    parser.add_argument("--timidity", type=str, default="timidity", help="timidity binary, used for MIDI.")
+    args = parser.parse_args()
+
+    tracks: List[str] = []
+    for root, dirs, files in os.walk(args.directory):
+        dirs.sort()
+        for name in sorted(files):
+            if os.path.splitext(name)[1].lower() in ELIGIBLE:
+                tracks.append(os.path.join(root, name))
+
+    with multiprocessing.Pool(args.jobs) as pool:
+        results = pool.map(scan, [(track, args) for track in tracks])
+
+    lines = []
+    for path, loudness, peak in results:
+        relpath = os.path.relpath(path, args.directory).replace(os.sep, "/")
+        if loudness is None:
+            print(f"{relpath}: silent, leaving it alone")
+            continue
+
+        gain_db = min(MAX_GAIN_DB, max(MIN_GAIN_DB, args.target - loudness))
+        gain = int(round(4096 * math.pow(10.0, gain_db / 20.0)))
+        lines.append(f"{gain} {peak} {relpath}\n")
+        print(f"{relpath}: loudness {loudness:.1f}dB, peak {peak}, gain {gain_db:+.1f}dB")
+
+    with open(os.path.join(args.directory, OUTPUT), "w") as tfp:
+        tfp.writelines(lines)
+    print(f"Wrote gains for {len(lines)} of {len(tracks)} tracks to {OUTPUT}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
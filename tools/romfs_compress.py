@@ -0,0 +1,200 @@
+#! /usr/bin/env python3
+# Compresses eligible files in a staged ROM FS directory into a block compressed
+# LZ4 container that lz4file.c can decompress on the fly. Each file is split into
+# fixed size blocks that are compressed independently, with an index of block
+# offsets up front so any position can be reached by decompressing one block.
+#
+# Container layout, all values little endian:
+#
+#   "LZ4B"
+#   uint32 original size
+#   uint32 block size
+#   uint32 block count
+#   uint32 offsets[block count + 1], relative to the end of this table
+#   block data, a block whose stored size equals its original size is raw
+import argparse
+import os
+import struct
+import sys
+from typing import List
+
+
+BLOCK_SIZE = 16384
+SUFFIX = ".lz4"
+
+# Formats that are read through the lz4:// filesystem, which unpacks them as they
+# are read. Instrument patches are included since the timidity config is pointed at
+# lz4:// too, mp3/ogg are already compressed.
+ELIGIBLE = {".mod", ".s3m", ".xm", ".it", ".mid", ".midi", ".pat"}
+
+# Timidity configs whose patch directories get pointed at lz4://, which also passes
+# through any patch that didn't shrink enough to be compressed.
+CONFIGS = {".cfg"}
+ROMFS_PREFIX = "rom://"
+LZ4FS_PREFIX = "lz4://"
+
+# Don't bother if we can't save at least this fraction of the file.
+MIN_SAVINGS = 0.05
+
+
+def _emit(out: bytearray, literals: bytes, offset: int, matchlen: int) -> None:
+    litlen = len(literals)
+    token = (min(litlen, 15) << 4) | (min(matchlen - 4, 15) if offset else 0)
+    out.append(token)
+    if litlen >= 15:
+        remaining = litlen - 15
+        while remaining >= 255:
+            out.append(255)
+            remaining -= 255
+        out.append(remaining)
+    out += literals
+    if offset:
+        out += struct.pack("<H", offset)
+        if matchlen - 4 >= 15:
+            remaining = matchlen - 4 - 15
+            while remaining >= 255:
+                out.append(255)
+                remaining -= 255
+            out.append(remaining)
+
+
+def compress_block(src: bytes) -> bytes:
+    # Greedy LZ4 block compressor. Follows the format's end of block rules, the last
+    # match must start 12 bytes before the end and the last 5 bytes are literals.
+    out = bytearray()
+    length = len(src)
+    table = {}
+    anchor = 0
+    pos = 0
+    limit = length - 12
+
+    while pos < limit:
+        key = src[pos:pos + 4]
+        ref = table.get(key)
+        table[key] = pos
+
+        if ref is not None and pos - ref <= 0xFFFF:
+            matchlen = 4
+            maxlen = length - 5 - pos
+            while matchlen < maxlen and src[ref + matchlen] == src[pos + matchlen]:
+                matchlen += 1
+
+            _emit(out, src[anchor:pos], pos - ref, matchlen)
+            pos += matchlen
+            anchor = pos
+        else:
+            pos += 1
+
+    _emit(out, src[anchor:], 0, 0)
+    return bytes(out)
+
+
+def decompress_block(src: bytes, size: int) -> bytes:
+    out = bytearray()
+    pos = 0
+    while pos < len(src):
+        token = src[pos]
+        pos += 1
+        litlen = token >> 4
+        if litlen == 15:
+            while True:
+                extra = src[pos]
+                pos += 1
+                litlen += extra
+                if extra != 255:
+                    break
+        out += src[pos:pos + litlen]
+        pos += litlen
+        if pos >= len(src):
+            break
+        offset = src[pos] | (src[pos + 1] << 8)
+        pos += 2
+        matchlen = (token & 0xF) + 4
+        if (token & 0xF) == 15:
+            while True:
+                extra = src[pos]
+                pos += 1
+                matchlen += extra
+                if extra != 255:
+                    break
+        for _ in range(matchlen):
+            out.append(out[-offset])
+    if len(out) != size:
+        raise Exception(f"Decompressed {len(out)} bytes, expected {size}")
+    return bytes(out)
+
+
+def compress_file(data: bytes) -> bytes:
+    blocks: List[bytes] = []
+    for start in range(0, len(data), BLOCK_SIZE):
+        raw = data[start:start + BLOCK_SIZE]
+        packed = compress_block(raw)
+        if len(packed) >= len(raw):
+            # Incompressible, store it as-is.
+            packed = raw
+        elif decompress_block(packed, len(raw)) != raw:
+            raise Exception("Compressor round trip failed!")
+        blocks.append(packed)
+
+    offsets = [0]
+    for block in blocks:
+        offsets.append(offsets[-1] + len(block))
+
+    header = b"LZ4B" + struct.pack("<III", len(data), BLOCK_SIZE, len(blocks))
+    return header + struct.pack(f"<{len(offsets)}I", *offsets) + b"".join(blocks)
+
+
+def rewrite_config(data: bytes) -> bytes:
+    lines = data.split(b"\n")
+    for i, line in enumerate(lines):
+        words = line.split()
+        if len(words) >= 2 and words[0] == b"dir" and words[1].startswith(ROMFS_PREFIX.encode("ascii")):
+            lines[i] = line.replace(ROMFS_PREFIX.encode("ascii"), LZ4FS_PREFIX.encode("ascii"), 1)
+    return b"\n".join(lines)
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Compress eligible files in a staged ROM FS directory in place.")
+    parser.add_argument("directory", metavar="DIR", type=str, help="Staged ROM FS directory to compress.")
+    args = parser.parse_args()
+
+    original_total = 0
+    compressed_total = 0
+    count = 0
+
+    for root, _, files in os.walk(args.directory):
+        for name in sorted(files):
+            path = os.path.join(root, name)
+            with open(path, "rb") as bfp:
+                data = bfp.read()
+
+            if os.path.splitext(name)[1].lower() in CONFIGS:
+                data = rewrite_config(data)
+                with open(path, "wb") as bfp:
+                    bfp.write(data)
+
+            original_total += len(data)
+            if os.path.splitext(name)[1].lower() not in ELIGIBLE or len(data) == 0:
+                compressed_total += len(data)
+                continue
+
+            packed = compress_file(data)
+            if len(packed) > len(data) * (1.0 - MIN_SAVINGS):
+                compressed_total += len(data)
+                continue
+
+            with open(path + SUFFIX, "wb") as bfp:
+                bfp.write(packed)
+            os.remove(path)
+
+            compressed_total += len(packed)
+            count += 1
+            print(f"{os.path.relpath(path, args.directory)}: {len(data)} -> {len(packed)} bytes ({100.0 * len(packed) / len(data):.1f}%)")
+
+    saved = original_total - compressed_total
+    print(f"Compressed {count} files, ROM FS {original_total} -> {compressed_total} bytes, saved {saved} bytes ({(100.0 * saved / original_total) if original_total else 0.0:.1f}%)")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
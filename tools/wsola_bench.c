@@ -0,0 +1,135 @@
+// Host build of the time-stretch engine, for measuring what it costs at each tempo
+// without having to run on the target. Build and run it with "make wsola-bench".
+// With no arguments it stretches a few seconds of synthesized music, otherwise it
+// stretches raw 44.1kHz interleaved stereo 16-bit PCM, such as the output of
+// "ffmpeg -i track.ogg -f s16le -ac 2 -ar 44100 track.raw".
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "wsola.h"
+
+#define SAMPLERATE 44100
+#define SYNTH_SECONDS 10
+
+static uint32_t *synthesize(unsigned int *numsamples)
+{
+    // A chord with a bass line under it and a percussive envelope, which gives the
+    // correlation search both steady tones and transients to deal with.
+    static const double notes[] = { 220.0, 277.18, 329.63 };
+    unsigned int count = SAMPLERATE * SYNTH_SECONDS;
+    uint32_t *samples = malloc(count * sizeof(uint32_t));
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        double t = (double)i / SAMPLERATE;
+        double beat = fmod(t, 0.5);
+        double envelope = exp(-beat * 6.0);
+        double bass = sin(2.0 * M_PI * (fmod(t, 2.0) < 1.0 ? 55.0 : 73.42) * t);
+        double left = 0.3 * bass;
+        double right = 0.3 * bass;
+
+        for (int j = 0; j < 3; j++)
+        {
+            double tone = sin(2.0 * M_PI * notes[j] * t) * envelope * 0.2;
+            left += tone * (j == 0 ? 1.0 : 0.5);
+            right += tone * (j == 2 ? 1.0 : 0.5);
+        }
+
+        int16_t l = (int16_t)(left * 32767.0);
+        int16_t r = (int16_t)(right * 32767.0);
+        samples[i] = (uint16_t)l | ((uint32_t)(uint16_t)r << 16);
+    }
+
+    *numsamples = count;
+    return samples;
+}
+
+static uint32_t *load(const char *filename, unsigned int *numsamples)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        return 0;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    uint32_t *samples = malloc(size);
+    *numsamples = fread(samples, sizeof(uint32_t), size / sizeof(uint32_t), fp);
+    fclose(fp);
+    return samples;
+}
+
+static unsigned int drain(wsola_t *wsola, uint32_t *checksum)
+{
+    unsigned int produced = 0;
+    const uint32_t *samples;
+    unsigned int amount;
+
+    while ((amount = wsola_output(wsola, &samples)) > 0)
+    {
+        for (unsigned int i = 0; i < amount; i++)
+        {
+            *checksum = (*checksum * 31) + samples[i];
+        }
+        wsola_consume(wsola, amount);
+        produced += amount;
+    }
+
+    return produced;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int numsamples = 0;
+    uint32_t *samples = argc > 1 ? load(argv[1], &numsamples) : synthesize(&numsamples);
+    if (!samples || numsamples == 0)
+    {
+        fprintf(stderr, "Couldn't load samples from %s!\n", argv[1]);
+        return 1;
+    }
+
+    static wsola_t wsola;
+    double seconds = (double)numsamples / SAMPLERATE;
+    printf("Stretching %.1f seconds of audio\n", seconds);
+
+    for (unsigned int percent = 50; percent <= 200; percent += 25)
+    {
+        unsigned int tempo = (percent * WSOLA_UNITY) / 100;
+        unsigned int produced = 0;
+        uint32_t checksum = 0;
+
+        wsola_init(&wsola, tempo);
+        clock_t start = clock();
+
+        unsigned int fed = 0;
+        while (fed < numsamples)
+        {
+            fed += wsola_feed(&wsola, &samples[fed], numsamples - fed);
+            produced += drain(&wsola, &checksum);
+        }
+        wsola_flush(&wsola);
+        produced += drain(&wsola, &checksum);
+
+        double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+        double output_seconds = (double)produced / SAMPLERATE;
+
+        printf(
+            "  Tempo %3u%%: %6.2fs out (expected %6.2fs), %7.1fus per second of output, %5.3f%% of real time, checksum %08x\n",
+            percent,
+            output_seconds,
+            seconds * 100.0 / percent,
+            (elapsed * 1000000.0) / output_seconds,
+            (elapsed * 100.0) / output_seconds,
+            checksum
+        );
+    }
+
+    free(samples);
+    return 0;
+}
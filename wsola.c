@@ -0,0 +1,239 @@
+#include <stdint.h>
+#include <string.h>
+#include "wsola.h"
+
+// Correlation runs on mono samples scaled down to 12 bits, so that a whole window of
+// products still fits in 32 bits. The refine pass only looks at every other sample
+// for the same reason.
+#define WSOLA_MONO(sample) (((int32_t)(int16_t)((sample) & 0xFFFF) + (int32_t)(int16_t)((sample) >> 16)) >> 5)
+#define WSOLA_REFINE_STRIDE 2
+
+void wsola_init(wsola_t *wsola, unsigned int tempo)
+{
+    memset(wsola, 0, sizeof(wsola_t));
+    wsola_set_tempo(wsola, tempo);
+}
+
+void wsola_set_tempo(wsola_t *wsola, unsigned int tempo)
+{
+    if (tempo < WSOLA_MIN_TEMPO) { tempo = WSOLA_MIN_TEMPO; }
+    if (tempo > WSOLA_MAX_TEMPO) { tempo = WSOLA_MAX_TEMPO; }
+    wsola->tempo = tempo;
+}
+
+unsigned int wsola_feed(wsola_t *wsola, const uint32_t *samples, unsigned int numsamples)
+{
+    unsigned int amount = WSOLA_INPUT_SAMPLES - wsola->input_fill;
+    if (amount > numsamples)
+    {
+        amount = numsamples;
+    }
+
+    memcpy(&wsola->input[wsola->input_fill], samples, amount * sizeof(uint32_t));
+    wsola->input_fill += amount;
+    return amount;
+}
+
+static void decimate(int16_t *out, const uint32_t *samples, unsigned int outsamples)
+{
+    for (unsigned int i = 0; i < outsamples; i++)
+    {
+        int32_t sum = 0;
+        for (unsigned int j = 0; j < WSOLA_DECIMATE; j++)
+        {
+            sum += WSOLA_MONO(samples[j]);
+        }
+        out[i] = sum / WSOLA_DECIMATE;
+        samples += WSOLA_DECIMATE;
+    }
+}
+
+static int64_t score(int32_t correlation, int32_t energy)
+{
+    // Normalized cross-correlation, squared so we don't need a square root, but
+    // keeping the sign so that a match that is out of phase never wins. This runs
+    // on the mixer thread, so it stays in integers. The correlation fits in 31 bits,
+    // so its square fits in 64.
+    int64_t corr = correlation;
+    return (corr * (corr < 0 ? -corr : corr)) / ((int64_t)energy + 1);
+}
+
+static unsigned int search(wsola_t *wsola)
+{
+    const unsigned int reflen = WSOLA_OVERLAP_SAMPLES / WSOLA_DECIMATE;
+    const unsigned int candidates = WSOLA_SEEK_SAMPLES / WSOLA_DECIMATE;
+    int16_t *ref = wsola->decimated_reference;
+    int16_t *in = wsola->decimated_input;
+
+    // Coarse pass, find the decimated offset where the start of a new sequence looks
+    // most like the audio that naturally followed the last one.
+    decimate(ref, wsola->overlap, reflen);
+    decimate(in, wsola->input, candidates + reflen);
+
+    int32_t energy = 0;
+    for (unsigned int i = 0; i < reflen; i++)
+    {
+        energy += in[i] * in[i];
+    }
+
+    unsigned int best = 0;
+    int64_t best_score = 0;
+    for (unsigned int offset = 0; offset < candidates; offset++)
+    {
+        int32_t correlation = 0;
+        for (unsigned int i = 0; i < reflen; i++)
+        {
+            correlation += ref[i] * in[offset + i];
+        }
+
+        int64_t current = score(correlation, energy);
+        if (offset == 0 || current > best_score)
+        {
+            best = offset;
+            best_score = current;
+        }
+
+        energy += (in[offset + reflen] * in[offset + reflen]) - (in[offset] * in[offset]);
+    }
+
+    // Fine pass at full rate, around the best coarse match.
+    for (unsigned int i = 0; i < WSOLA_OVERLAP_SAMPLES; i += WSOLA_REFINE_STRIDE)
+    {
+        wsola->reference[i] = WSOLA_MONO(wsola->overlap[i]);
+    }
+
+    int first = (best * WSOLA_DECIMATE) - (WSOLA_DECIMATE - 1);
+    int last = (best * WSOLA_DECIMATE) + (WSOLA_DECIMATE - 1);
+    if (first < 0) { first = 0; }
+    if (last > WSOLA_SEEK_SAMPLES - 1) { last = WSOLA_SEEK_SAMPLES - 1; }
+
+    best = best * WSOLA_DECIMATE;
+    best_score = 0;
+    for (int offset = first; offset <= last; offset++)
+    {
+        const uint32_t *samples = &wsola->input[offset];
+        int32_t correlation = 0;
+        energy = 0;
+
+        for (unsigned int i = 0; i < WSOLA_OVERLAP_SAMPLES; i += WSOLA_REFINE_STRIDE)
+        {
+            int32_t sample = WSOLA_MONO(samples[i]);
+            correlation += wsola->reference[i] * sample;
+            energy += sample * sample;
+        }
+
+        int64_t current = score(correlation, energy);
+        if (offset == first || current > best_score)
+        {
+            best = offset;
+            best_score = current;
+        }
+    }
+
+    return best;
+}
+
+static void crossfade(uint32_t *out, const uint32_t *from, const uint32_t *to)
+{
+    for (unsigned int i = 0; i < WSOLA_OVERLAP_SAMPLES; i++)
+    {
+        int32_t fromleft = (int16_t)(from[i] & 0xFFFF);
+        int32_t fromright = (int16_t)(from[i] >> 16);
+        int32_t toleft = (int16_t)(to[i] & 0xFFFF);
+        int32_t toright = (int16_t)(to[i] >> 16);
+        int32_t fade = WSOLA_OVERLAP_SAMPLES - i;
+
+        int32_t left = ((fromleft * fade) + (toleft * (int32_t)i)) >> WSOLA_OVERLAP_SHIFT;
+        int32_t right = ((fromright * fade) + (toright * (int32_t)i)) >> WSOLA_OVERLAP_SHIFT;
+        out[i] = (left & 0xFFFF) | ((uint32_t)right << 16);
+    }
+}
+
+static void stretch(wsola_t *wsola)
+{
+    // The very first sequence has nothing to line up with, so it starts where it is.
+    unsigned int offset = wsola->primed ? search(wsola) : 0;
+    const uint32_t *samples = &wsola->input[offset];
+
+    if (wsola->primed)
+    {
+        crossfade(wsola->output, wsola->overlap, samples);
+    }
+    else
+    {
+        memcpy(wsola->output, samples, WSOLA_OVERLAP_SAMPLES * sizeof(uint32_t));
+    }
+    memcpy(
+        &wsola->output[WSOLA_OVERLAP_SAMPLES],
+        &samples[WSOLA_OVERLAP_SAMPLES],
+        (WSOLA_SEQUENCE_SAMPLES - (2 * WSOLA_OVERLAP_SAMPLES)) * sizeof(uint32_t)
+    );
+
+    // Hold back the end of the sequence to fade into the next one.
+    memcpy(
+        wsola->overlap,
+        &samples[WSOLA_SEQUENCE_SAMPLES - WSOLA_OVERLAP_SAMPLES],
+        WSOLA_OVERLAP_SAMPLES * sizeof(uint32_t)
+    );
+
+    wsola->output_fill = WSOLA_SEQUENCE_SAMPLES - WSOLA_OVERLAP_SAMPLES;
+    wsola->output_pos = 0;
+    wsola->primed = 1;
+
+    // Move through the input at the tempo's rate, no matter where the search put us.
+    uint32_t advance = ((WSOLA_SEQUENCE_SAMPLES - WSOLA_OVERLAP_SAMPLES) * wsola->tempo) + wsola->skip_frac;
+    unsigned int skip = advance >> 16;
+    wsola->skip_frac = advance & 0xFFFF;
+
+    memmove(wsola->input, &wsola->input[skip], (wsola->input_fill - skip) * sizeof(uint32_t));
+    wsola->input_fill -= skip;
+    wsola->continuation = (int)(offset + WSOLA_SEQUENCE_SAMPLES) - (int)skip;
+}
+
+unsigned int wsola_output(wsola_t *wsola, const uint32_t **samples)
+{
+    if (wsola->output_pos == wsola->output_fill && wsola->input_fill == WSOLA_INPUT_SAMPLES)
+    {
+        stretch(wsola);
+    }
+
+    *samples = &wsola->output[wsola->output_pos];
+    return wsola->output_fill - wsola->output_pos;
+}
+
+void wsola_consume(wsola_t *wsola, unsigned int numsamples)
+{
+    wsola->output_pos += numsamples;
+}
+
+unsigned int wsola_flush(wsola_t *wsola)
+{
+    const uint32_t *samples;
+    unsigned int pending = wsola_output(wsola, &samples);
+    if (pending > 0)
+    {
+        // Let what's already been stretched play out first.
+        return pending;
+    }
+
+    unsigned int amount = 0;
+    if (wsola->primed)
+    {
+        memcpy(wsola->output, wsola->overlap, WSOLA_OVERLAP_SAMPLES * sizeof(uint32_t));
+        amount = WSOLA_OVERLAP_SAMPLES;
+    }
+
+    int start = wsola->continuation < 0 ? 0 : wsola->continuation;
+    if (start < wsola->input_fill)
+    {
+        memcpy(&wsola->output[amount], &wsola->input[start], (wsola->input_fill - start) * sizeof(uint32_t));
+        amount += wsola->input_fill - start;
+    }
+
+    wsola->output_fill = amount;
+    wsola->output_pos = 0;
+    wsola->input_fill = 0;
+    wsola->continuation = 0;
+    wsola->primed = 0;
+    return amount;
+}
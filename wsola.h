@@ -0,0 +1,75 @@
+#ifndef __WSOLA_H
+#define __WSOLA_H
+
+#include <stdint.h>
+
+// Tempos are 16.16 fixed point input samples consumed per output sample, so this
+// plays at the original speed.
+#define WSOLA_UNITY 0x10000
+#define WSOLA_MIN_TEMPO (WSOLA_UNITY / 2)
+#define WSOLA_MAX_TEMPO (WSOLA_UNITY * 2)
+
+// Output is built from sequences of input this many stereo samples long, each one
+// cross-faded into the last over the overlap. The overlap must be a power of 2.
+#define WSOLA_SEQUENCE_SAMPLES 2048
+#define WSOLA_OVERLAP_SAMPLES 512
+#define WSOLA_OVERLAP_SHIFT 9
+
+// How far past its natural position each sequence can be moved to line it up with
+// the one before. The search first runs over a mono copy decimated by this factor,
+// then refines the best match at full rate. With these sizes that is about 24
+// multiplies per output sample, which leaves the mixer well within its budget.
+#define WSOLA_SEEK_SAMPLES 1024
+#define WSOLA_DECIMATE 4
+
+// Input we need on hand to produce a sequence, and the most output one call produces.
+#define WSOLA_INPUT_SAMPLES (WSOLA_SEEK_SAMPLES + WSOLA_SEQUENCE_SAMPLES)
+#define WSOLA_OUTPUT_SAMPLES (WSOLA_OVERLAP_SAMPLES + WSOLA_INPUT_SAMPLES)
+
+typedef struct
+{
+    unsigned int tempo;
+    uint32_t skip_frac;
+    int primed;
+
+    // Where the audio that follows the saved overlap starts in the input, so that
+    // flushing can pick up exactly where the last sequence left off.
+    int continuation;
+
+    uint32_t input[WSOLA_INPUT_SAMPLES];
+    unsigned int input_fill;
+
+    uint32_t overlap[WSOLA_OVERLAP_SAMPLES];
+
+    uint32_t output[WSOLA_OUTPUT_SAMPLES];
+    unsigned int output_fill;
+    unsigned int output_pos;
+
+    // Scratch space for the correlation search.
+    int16_t reference[WSOLA_OVERLAP_SAMPLES];
+    int16_t decimated_reference[WSOLA_OVERLAP_SAMPLES / WSOLA_DECIMATE];
+    int16_t decimated_input[(WSOLA_SEEK_SAMPLES + WSOLA_OVERLAP_SAMPLES) / WSOLA_DECIMATE];
+} wsola_t;
+
+// Start stretching a new stream of interleaved stereo 16-bit samples.
+void wsola_init(wsola_t *wsola, unsigned int tempo);
+
+// Change the tempo, which takes effect from the next sequence. Tempos outside of
+// WSOLA_MIN_TEMPO and WSOLA_MAX_TEMPO are clamped.
+void wsola_set_tempo(wsola_t *wsola, unsigned int tempo);
+
+// Hand input to the stretcher, returning how many samples it took. This is 0 once
+// it has all the input it needs for the next sequence.
+unsigned int wsola_feed(wsola_t *wsola, const uint32_t *samples, unsigned int numsamples);
+
+// Get at stretched output, producing another sequence if everything produced so far
+// has been consumed and enough input is waiting. Returns how many samples are at
+// *samples, or 0 if more input is needed.
+unsigned int wsola_output(wsola_t *wsola, const uint32_t **samples);
+void wsola_consume(wsola_t *wsola, unsigned int numsamples);
+
+// Once the source has ended, pass whatever input is left through unstretched so the
+// end of the stream isn't lost. Returns how many samples wsola_output() now has.
+unsigned int wsola_flush(wsola_t *wsola);
+
+#endif